@@ -0,0 +1,64 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <time.h>
+
+#include "animation.h"
+#include "pacing.h"
+
+VFDAnimation::VFDAnimation(VFD *vfd)
+{
+    m_vfd = vfd;
+    m_x = m_y = 0;
+    m_plays = 0;
+}
+
+bool VFDAnimation::open(const char *path)
+{
+    return m_apng.open(path);
+}
+
+int VFDAnimation::run()
+{
+    catchStop();
+
+    int plays = m_plays ? m_plays : m_apng.plays();
+    struct timespec due;
+    clock_gettime(CLOCK_MONOTONIC, &due);
+
+    m_vfd->clear();
+    for (int play = 0; !stopRequested() && (plays == 0 || play < plays); play++)
+    {
+        for (int i = 0; !stopRequested() && i < m_apng.frames(); i++)
+        {
+            eRect changed = m_apng.renderFrame(i);
+            m_vfd->drawSurface(m_apng.canvas(), changed, m_x, m_y);
+
+            /* the last frame stays on the panel */
+            if (plays && play + 1 == plays && i + 1 == m_apng.frames())
+                break;
+            int delay = m_apng.delay(i);
+            /* like browsers, 0 to 10 ms is taken as 100 ms instead of spinning */
+            if (delay <= 10)
+                delay = 100;
+            waitUntil(due, delay);
+        }
+    }
+    m_vfd->flush();
+    return 0;
+}
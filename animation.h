@@ -0,0 +1,48 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _ANIMATION_H_
+#define _ANIMATION_H_
+
+#include "vfd.h"
+#include "apng.h"
+
+/*
+ * Plays an animated png on the panel at the delays stored in the file,
+ * delays of 10 ms or less play as 100 ms.
+ * Only the canvas area a frame changed is drawn and converted.
+ */
+class VFDAnimation
+{
+private:
+    VFD *m_vfd;
+    APNG m_apng;
+    int m_x, m_y;
+    int m_plays;
+
+public:
+    VFDAnimation(VFD *vfd);
+
+    bool open(const char *path);
+    void setPosition(int x, int y) { m_x = x; m_y = y; }
+    /* number of plays, 0 takes the count from the file (where 0 is endless) */
+    void setPlays(int plays) { m_plays = plays; }
+    /* returns after the last play or on SIGTERM/SIGINT */
+    int run();
+};
+
+#endif
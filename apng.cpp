@@ -0,0 +1,321 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <zlib.h>
+#include <cstring>
+
+#include "apng.h"
+#include "pngdecoder.h"
+#include "surfacepool.h"
+
+#define APNG_MAX_SIZE 65535
+
+static const unsigned char pngSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+static uint32_t get32(const unsigned char *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put32(std::string &out, uint32_t v)
+{
+    char b[4] = { (char)(v >> 24), (char)(v >> 16), (char)(v >> 8), (char)v };
+    out.append(b, 4);
+}
+
+static void putChunk(std::string &out, const char *type, const std::string &data)
+{
+    put32(out, data.size());
+    out.append(type, 4);
+    out += data;
+    uLong crc = crc32(0, (const Bytef *)type, 4);
+    crc = crc32(crc, (const Bytef *)data.data(), data.size());
+    put32(out, crc);
+}
+
+static bool readFile(const char *filename, std::string &out)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return false;
+    char buf[65536];
+    size_t r;
+    while ((r = fread(buf, 1, sizeof(buf), f)) > 0)
+        out.append(buf, r);
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+APNG::APNG()
+{
+    m_width = m_height = 0;
+    m_plays = 0;
+    m_canvas = NULL;
+    m_disposeOp = disposeNone;
+}
+
+APNG::~APNG()
+{
+    delete m_canvas;
+}
+
+bool APNG::isAnimated(const char *filename)
+{
+    /* acTL has to come before the first IDAT, the header is enough */
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return false;
+    unsigned char buf[8];
+    bool animated = false;
+    if (fread(buf, 8, 1, f) == 1 && !memcmp(buf, pngSignature, 8))
+    {
+        while (fread(buf, 8, 1, f) == 1)
+        {
+            if (!memcmp(buf + 4, "acTL", 4))
+                animated = true;
+            if (animated || !memcmp(buf + 4, "IDAT", 4) || fseek(f, get32(buf) + 4, SEEK_CUR) != 0)
+                break;
+        }
+    }
+    fclose(f);
+    return animated;
+}
+
+bool APNG::open(const char *filename)
+{
+    std::string file;
+    if (!readFile(filename, file) || file.size() < 8 || memcmp(file.data(), pngSignature, 8))
+        return false;
+
+    const unsigned char *p = (const unsigned char *)file.data();
+    size_t pos = 8;
+    bool animated = false, idat = false, fdat = false;
+    int current = -1;
+
+    while (pos + 12 <= file.size())
+    {
+        uint32_t len = get32(p + pos);
+        const char *type = (const char *)p + pos + 4;
+        if (len > file.size() - pos - 12)
+        {
+            printf("[uPNG] %s: chunk runs past the end of the file\n", filename);
+            return false;
+        }
+        const unsigned char *data = p + pos + 8;
+        if (crc32(crc32(0, (const Bytef *)type, 4), data, len) != get32(data + len))
+        {
+            printf("[uPNG] %s: bad crc in %.4s\n", filename, type);
+            return false;
+        }
+
+        if (!memcmp(type, "IHDR", 4) && len == 13)
+        {
+            uint32_t width = get32(data), height = get32(data + 4);
+            if (!width || !height || width > APNG_MAX_SIZE || height > APNG_MAX_SIZE)
+            {
+                printf("[uPNG] %s: invalid image size %ux%u\n", filename, width, height);
+                return false;
+            }
+            m_ihdr.assign((const char *)data, len);
+            m_width = width;
+            m_height = height;
+        }
+        else if (!memcmp(type, "acTL", 4) && len == 8)
+        {
+            animated = true;
+            m_plays = get32(data + 4);
+        }
+        else if (!memcmp(type, "fcTL", 4) && len == 26)
+        {
+            Frame f;
+            f.width = get32(data + 4);
+            f.height = get32(data + 8);
+            f.x = get32(data + 12);
+            f.y = get32(data + 16);
+            int num = (data[20] << 8) | data[21];
+            int den = (data[22] << 8) | data[23];
+            f.delay = num * 1000 / (den ? den : 100);
+            f.dispose = data[24];
+            f.blend = data[25];
+            m_frames.push_back(f);
+            current = m_frames.size() - 1;
+        }
+        else if (!memcmp(type, "IDAT", 4))
+        {
+            /* the default image is the first frame only if its fcTL came first */
+            if (current == 0 && !fdat)
+                m_frames[0].data.append((const char *)data, len);
+            idat = true;
+        }
+        else if (!memcmp(type, "fdAT", 4) && len > 4)
+        {
+            if (current < 0)
+                return false;
+            m_frames[current].data.append((const char *)data + 4, len - 4);
+            fdat = true;
+        }
+        else if (!memcmp(type, "IEND", 4))
+            break;
+        else if (!idat)
+            m_shared.append((const char *)p + pos, len + 12);
+        pos += len + 12;
+    }
+
+    if (!animated || m_ihdr.empty() || m_frames.empty())
+        return false;
+    for (size_t i = 0; i < m_frames.size(); i++)
+    {
+        const Frame &f = m_frames[i];
+        if (f.width <= 0 || f.height <= 0 || f.x < 0 || f.y < 0
+            || f.width > m_width || f.x > m_width - f.width || f.height > m_height || f.y > m_height - f.height
+            || f.dispose > disposePrevious || f.blend > blendOver || f.data.empty())
+        {
+            printf("[uPNG] %s: invalid frame %zu\n", filename, i);
+            return false;
+        }
+    }
+
+    m_canvas = new gSurface(m_width, m_height, 32);
+    memset(m_canvas->data, 0, (size_t)m_canvas->y * m_canvas->stride);
+    return true;
+}
+
+/*
+ * Decode one frame as a stand-alone png, always returns 32bpp. The png is
+ * built in the same buffer every time and the surfaces come from the pool,
+ * so playing an animation again allocates nothing.
+ */
+std::shared_ptr<gSurface> APNG::decodeFrame(const Frame &f)
+{
+    std::string ihdr;
+    put32(ihdr, f.width);
+    put32(ihdr, f.height);
+    ihdr.append(m_ihdr, 8, std::string::npos);
+    m_frame.assign((const char *)pngSignature, 8);
+    putChunk(m_frame, "IHDR", ihdr);
+    m_frame += m_shared;
+    putChunk(m_frame, "IDAT", f.data);
+    putChunk(m_frame, "IEND", std::string());
+
+    FrameArena::Scope scope(m_arena);
+    PNGDecoder decoder;
+    decoder.setArena(&m_arena);
+    if (!decoder.open(m_frame.data(), m_frame.size()))
+        return std::shared_ptr<gSurface>();
+    std::shared_ptr<gSurface> img = SurfacePool::shared().get(decoder.width(), decoder.height(), decoder.bpp());
+    if (!decoder.readImage(img.get()))
+        return std::shared_ptr<gSurface>();
+    decoder.getPalette(img.get());
+    if (img->bpp == 32)
+        return img;
+
+    /* palette and gray frames are expanded with their alpha */
+    std::shared_ptr<gSurface> rgba = SurfacePool::shared().get(img->x, img->y, 32);
+    m_png.blitFrom(img.get(), rgba.get(), eRect(0, 0, img->x, img->y), 0);
+    return rgba;
+}
+
+/* copy src into the canvas, NULL clears the area */
+void APNG::fill(const eRect &area, const gUnmanagedSurface *src)
+{
+    for (int y = 0; y < area.height(); y++)
+    {
+        uint8_t *dst = (uint8_t *)m_canvas->data + (size_t)(area.top() + y) * m_canvas->stride + area.left() * 4;
+        if (src)
+            memcpy(dst, (const uint8_t *)src->data + (size_t)y * src->stride, area.width() * 4);
+        else
+            memset(dst, 0, area.width() * 4);
+    }
+}
+
+void APNG::compose(const gUnmanagedSurface *src, const Frame &f)
+{
+    if (f.blend == blendSource)
+    {
+        fill(eRect(f.x, f.y, f.width, f.height), src);
+        return;
+    }
+    for (int y = 0; y < f.height; y++)
+    {
+        const uint8_t *s = (const uint8_t *)src->data + (size_t)y * src->stride;
+        uint8_t *d = (uint8_t *)m_canvas->data + (size_t)(f.y + y) * m_canvas->stride + f.x * 4;
+        for (int x = 0; x < f.width; x++, s += 4, d += 4)
+        {
+            /* non premultiplied "over", bytes 0..2 are colour, byte 3 alpha */
+            int sa = s[3];
+            if (sa == 255)
+                memcpy(d, s, 4);
+            else if (sa)
+            {
+                int u = sa * 255, v = (255 - sa) * d[3];
+                int al = u + v;
+                d[0] = (s[0] * u + d[0] * v + al / 2) / al;
+                d[1] = (s[1] * u + d[1] * v + al / 2) / al;
+                d[2] = (s[2] * u + d[2] * v + al / 2) / al;
+                d[3] = (al + 127) / 255;
+            }
+        }
+    }
+}
+
+eRect APNG::renderFrame(int frame)
+{
+    const Frame &f = m_frames[frame];
+    eRect area(f.x, f.y, f.width, f.height);
+    eRect changed;
+
+    if (frame == 0)
+    {
+        /* every play starts on a transparent canvas */
+        fill(eRect(0, 0, m_width, m_height), NULL);
+        changed = eRect(0, 0, m_width, m_height);
+    }
+    else if (m_disposeOp == disposeBackground)
+    {
+        fill(m_dispose, NULL);
+        changed |= m_dispose;
+    }
+    else if (m_disposeOp == disposePrevious && m_saved)
+    {
+        fill(m_dispose, m_saved.get());
+        changed |= m_dispose;
+    }
+
+    int dispose = f.dispose;
+    if (frame == 0 && dispose == disposePrevious)
+        dispose = disposeBackground;
+    if (dispose == disposePrevious)
+    {
+        m_saved = SurfacePool::shared().get(f.width, f.height, 32);
+        for (int y = 0; y < f.height; y++)
+            memcpy((uint8_t *)m_saved->data + (size_t)y * m_saved->stride,
+                (const uint8_t *)m_canvas->data + (size_t)(f.y + y) * m_canvas->stride + f.x * 4, f.width * 4);
+    }
+
+    std::shared_ptr<gSurface> img = decodeFrame(f);
+    if (img && img->x == f.width && img->y == f.height)
+        compose(img.get(), f);
+    else
+        printf("[uPNG] couldn't decode frame %d\n", frame);
+
+    changed |= area;
+    m_dispose = area;
+    m_disposeOp = dispose;
+    return changed;
+}
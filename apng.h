@@ -0,0 +1,85 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _APNG_H_
+#define _APNG_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include "upng.h"
+
+/*
+ * Animated PNG. Every frame is turned into a small stand-alone png (the
+ * header with the frame size, the chunks shared by all frames and the
+ * frame data as IDAT), decoded on its own and composed onto a canvas of
+ * the full image size with the dispose and blend ops of the frame.
+ */
+class APNG
+{
+public:
+    enum { disposeNone = 0, disposeBackground = 1, disposePrevious = 2 };
+    enum { blendSource = 0, blendOver = 1 };
+
+private:
+    struct Frame
+    {
+        int x, y, width, height;
+        int delay; /* ms */
+        int dispose, blend;
+        std::string data; /* zlib stream, the IDAT/fdAT payloads joined */
+    };
+
+    std::string m_ihdr; /* IHDR payload */
+    std::string m_shared; /* chunks before the first IDAT, as in the file */
+    std::vector<Frame> m_frames;
+    int m_width, m_height;
+    int m_plays;
+
+    gSurface *m_canvas;
+    std::shared_ptr<gSurface> m_saved; /* canvas area under a frame with disposePrevious */
+    eRect m_dispose; /* area the last frame leaves to the dispose op */
+    int m_disposeOp;
+    uPNG m_png;
+    std::string m_frame; /* png of the frame being decoded */
+    FrameArena m_arena;
+
+    std::shared_ptr<gSurface> decodeFrame(const Frame &f);
+    void compose(const gUnmanagedSurface *src, const Frame &f);
+    void fill(const eRect &area, const gUnmanagedSurface *src);
+
+public:
+    APNG();
+    ~APNG();
+
+    /* false if filename is no animated png */
+    bool open(const char *filename);
+    static bool isAnimated(const char *filename);
+
+    int frames() const { return m_frames.size(); }
+    /* 0 plays forever */
+    int plays() const { return m_plays; }
+    int delay(int frame) const { return m_frames[frame].delay; }
+    /* 32bpp, the animation as it is after the last renderFrame() */
+    const gSurface *canvas() const { return m_canvas; }
+
+    /* draw frames in order, frame 0 starts over, returns the changed canvas area */
+    eRect renderFrame(int frame);
+};
+
+#endif
@@ -0,0 +1,349 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+
+#include "bitmapdecoder.h"
+#include "framearena.h"
+
+#define BITMAP_MAX_SIZE 65535
+
+static inline uint32_t le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline int le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+BitmapDecoder::BitmapDecoder(int width, int height, int bpp)
+{
+    m_fp = NULL;
+    m_data = NULL;
+    m_len = m_pos = 0;
+    m_format = bpp ? Dump : PGM;
+    m_width = width;
+    m_height = height;
+    m_bpp = bpp;
+    m_stride = 0;
+    m_offset = 0;
+    m_bottomUp = false;
+    m_alpha = false;
+    m_scaled = false;
+    m_line = NULL;
+    m_row = 0;
+}
+
+BitmapDecoder::~BitmapDecoder()
+{
+    if (!m_arena)
+        delete [] m_line;
+    if (m_fp)
+        fclose(m_fp);
+}
+
+bool BitmapDecoder::open(FILE *fp)
+{
+    m_fp = fp;
+    return start();
+}
+
+bool BitmapDecoder::open(const void *data, size_t len)
+{
+    m_data = (const unsigned char *)data;
+    m_len = len;
+    m_pos = 0;
+    return start();
+}
+
+bool BitmapDecoder::read(void *out, size_t len)
+{
+    if (m_fp)
+    {
+        if (len && fread(out, len, 1, m_fp) != 1)
+            return false;
+    }
+    else
+    {
+        if (len > m_len - m_pos)
+            return false;
+        memcpy(out, m_data + m_pos, len);
+    }
+    m_pos += len;
+    return true;
+}
+
+/* pipes can't seek, the bytes are read and dropped */
+bool BitmapDecoder::skip(size_t len)
+{
+    unsigned char buf[256];
+    while (len)
+    {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (!read(buf, n))
+            return false;
+        len -= n;
+    }
+    return true;
+}
+
+int BitmapDecoder::next()
+{
+    unsigned char c;
+    return read(&c, 1) ? c : -1;
+}
+
+/* a pnm header field, whitespace and comments before it are skipped */
+bool BitmapDecoder::number(int &value)
+{
+    int c = next();
+    while (c == '#' || c == ' ' || c == '\t' || c == '\r' || c == '\n')
+    {
+        if (c == '#')
+            while (c != '\n' && c != -1)
+                c = next();
+        c = next();
+    }
+    if (c < '0' || c > '9')
+        return false;
+    value = 0;
+    while (c >= '0' && c <= '9')
+    {
+        if (value > BITMAP_MAX_SIZE)
+            return false;
+        value = value * 10 + c - '0';
+        c = next();
+    }
+    /* exactly one whitespace ends the field, after maxval the pixels follow */
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool BitmapDecoder::readPNM()
+{
+    int type = next();
+    int maxval;
+    if (type != '5' && type != '6')
+        return false;
+    if (!number(m_width) || !number(m_height) || !number(maxval) || maxval < 1)
+        return false;
+    if (maxval > 255)
+    {
+        printf("[uPNG] 16 bit pnm images are not supported\n");
+        return false;
+    }
+
+    m_format = type == '5' ? PGM : PPM;
+    m_bpp = type == '5' ? 8 : 32;
+    m_stride = m_width * (type == '5' ? 1 : 3);
+    m_scaled = maxval != 255;
+    for (int i = 0; i < 256; i++)
+        m_scale[i] = i >= maxval ? 255 : (i * 255 + maxval / 2) / maxval;
+    return true;
+}
+
+bool BitmapDecoder::readBMP()
+{
+    unsigned char file[14], info[124], masks[16];
+    /* the B is already read */
+    if (!read(file + 1, 13) || file[1] != 'M' || !read(info, 4))
+        return false;
+    size_t size = le32(info);
+    if (size < 40 || size > sizeof(info) || !read(info + 4, size - 4))
+        return false;
+
+    int bitcount = le16(info + 14);
+    int compression = le32(info + 16);
+    if (bitcount != 32 || (compression != 0 && compression != 3 && compression != 6))
+    {
+        printf("[uPNG] only uncompressed 32 bit bmp images are supported\n");
+        return false;
+    }
+
+    /* the masks follow a plain info header, later versions include them */
+    size_t used = 14 + size;
+    m_alpha = false;
+    if (compression != 0)
+    {
+        const unsigned char *mask = info + 40;
+        bool alpha = size >= 56 || compression == 6;
+        if (size < 52)
+        {
+            size_t len = compression == 6 ? 16 : 12;
+            if (!read(masks, len))
+                return false;
+            used += len;
+            mask = masks;
+        }
+        if (le32(mask) != 0xFF0000 || le32(mask + 4) != 0xFF00 || le32(mask + 8) != 0xFF
+            || (alpha && le32(mask + 12) != 0xFF000000 && le32(mask + 12) != 0))
+        {
+            printf("[uPNG] only bgra bmp images are supported\n");
+            return false;
+        }
+        m_alpha = alpha && le32(mask + 12) != 0;
+    }
+
+    int height = (int)le32(info + 8);
+    m_width = (int)le32(info + 4);
+    m_height = height < 0 ? -height : height;
+    m_bottomUp = height > 0;
+    m_format = BMP;
+    m_bpp = 32;
+    m_stride = m_width * 4;
+
+    size_t offset = le32(file + 10);
+    return offset >= used && skip(offset - used);
+}
+
+bool BitmapDecoder::start()
+{
+    long base = m_fp ? ftell(m_fp) : 0;
+
+    if (m_format != Dump)
+    {
+        int c = next();
+        if (!(c == 'P' ? readPNM() : c == 'B' ? readBMP() : false))
+        {
+            printf("[uPNG] no valid pnm or bmp header\n");
+            return false;
+        }
+    }
+    else
+        m_stride = m_width * (m_bpp >> 3);
+    if (m_width <= 0 || m_height <= 0 || m_width > BITMAP_MAX_SIZE || m_height > BITMAP_MAX_SIZE)
+    {
+        printf("[uPNG] invalid image size %dx%d\n", m_width, m_height);
+        return false;
+    }
+    m_offset = base + m_pos;
+
+    if (!m_fp)
+    {
+        if ((size_t)m_stride * m_height > m_len - m_pos)
+        {
+            printf("[uPNG] image data truncated\n");
+            return false;
+        }
+    }
+    else
+    {
+        /* a bottom up bmp from a pipe can only be read as a whole */
+        m_interlaced = m_bottomUp && (base < 0 || fseek(m_fp, m_offset, SEEK_SET) != 0);
+        m_line = m_arena ? m_arena->alloc<unsigned char>(m_stride) : new unsigned char[m_stride];
+    }
+    return true;
+}
+
+/* row y of the image as stored in the source */
+const unsigned char *BitmapDecoder::sourceRow(int y)
+{
+    int row = m_bottomUp ? m_height - 1 - y : y;
+    if (!m_fp)
+        return m_data + m_offset + (size_t)row * m_stride;
+    if (m_bottomUp && !m_interlaced && fseek(m_fp, m_offset + (long)row * m_stride, SEEK_SET) != 0)
+        return NULL;
+    return fread(m_line, m_stride, 1, m_fp) == 1 ? m_line : NULL;
+}
+
+void BitmapDecoder::convert(unsigned char *dst, const unsigned char *src)
+{
+    switch (m_format)
+    {
+    case PGM:
+        if (!m_scaled)
+        {
+            memcpy(dst, src, m_width);
+            break;
+        }
+        for (int x = 0; x < m_width; x++)
+            dst[x] = m_scale[src[x]];
+        break;
+    case PPM:
+        for (int x = 0; x < m_width; x++, src += 3, dst += 4)
+        {
+            dst[0] = m_scale[src[2]];
+            dst[1] = m_scale[src[1]];
+            dst[2] = m_scale[src[0]];
+            dst[3] = 255;
+        }
+        break;
+    case BMP:
+        if (m_alpha)
+        {
+            memcpy(dst, src, m_stride);
+            break;
+        }
+        for (int x = 0; x < m_width; x++, src += 4, dst += 4)
+        {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+            dst[3] = 255;
+        }
+        break;
+    case Dump:
+        memcpy(dst, src, m_stride);
+        break;
+    }
+}
+
+void BitmapDecoder::getPalette(gUnmanagedSurface *surface)
+{
+    surface->clut.data = 0;
+    surface->clut.colors = 0;
+    surface->clut.start = 0;
+    surface->clut.lookup.reset();
+}
+
+bool BitmapDecoder::readImage(gUnmanagedSurface *surface)
+{
+    if (!m_interlaced)
+        return readRows((unsigned char *)surface->data, surface->stride, m_height);
+
+    /* stored bottom up and no way back, the rows are read in file order */
+    for (int y = m_height - 1; y >= 0; y--)
+    {
+        if (fread(m_line, m_stride, 1, m_fp) != 1)
+        {
+            printf("[uPNG] image data truncated\n");
+            return false;
+        }
+        convert((unsigned char *)surface->data + y * surface->stride, m_line);
+    }
+    m_row = m_height;
+    return true;
+}
+
+bool BitmapDecoder::readRows(unsigned char *data, int stride, int count)
+{
+    if (m_interlaced || m_row + count > m_height)
+        return false;
+    for (int i = 0; i < count; i++)
+    {
+        const unsigned char *src = sourceRow(m_row);
+        if (!src)
+        {
+            printf("[uPNG] image data truncated\n");
+            return false;
+        }
+        convert(data + i * stride, src);
+        m_row++;
+    }
+    return true;
+}
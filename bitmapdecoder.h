@@ -0,0 +1,72 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _BITMAPDECODER_H_
+#define _BITMAPDECODER_H_
+
+#include <stdio.h>
+#include "imagedecoder.h"
+
+/*
+ * Uncompressed images, their rows are copied or widened to the surface
+ * layout without going through zlib: binary PGM (gray), PPM (rgb), 32 bit
+ * BMP and headerless dumps of bgra or gray pixels.
+ */
+class BitmapDecoder: public ImageDecoder
+{
+private:
+    enum Format { PGM, PPM, BMP, Dump };
+
+    FILE *m_fp;
+    const unsigned char *m_data; /* memory source */
+    size_t m_len, m_pos;
+    Format m_format;
+    int m_stride;        /* bytes per row in the source */
+    long m_offset;       /* of the first pixel in the source */
+    bool m_bottomUp;     /* bmp rows are stored last row first */
+    bool m_alpha;        /* bmp alpha channel, otherwise the pixels are opaque */
+    bool m_scaled;       /* pnm maxval is not 255 */
+    unsigned char m_scale[256]; /* pnm samples to 0..255 */
+    unsigned char *m_line; /* one source row */
+    int m_row;           /* next row to read */
+
+    bool start();
+    bool read(void *out, size_t len);
+    bool skip(size_t len);
+    int next();
+    bool number(int &value);
+    bool readPNM();
+    bool readBMP();
+    const unsigned char *sourceRow(int y);
+    void convert(unsigned char *dst, const unsigned char *src);
+
+public:
+    /* a dump of width x height x bpp, otherwise the format is read from the header */
+    BitmapDecoder(int width = 0, int height = 0, int bpp = 0);
+    ~BitmapDecoder();
+
+    /* false if the image is in no known format or truncated */
+    bool open(const void *data, size_t len);
+    /* the same for a file or pipe, fp is closed with the decoder */
+    bool open(FILE *fp);
+
+    void getPalette(gUnmanagedSurface *surface);
+    bool readImage(gUnmanagedSurface *surface);
+    bool readRows(unsigned char *data, int stride, int count);
+};
+
+#endif
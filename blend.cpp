@@ -0,0 +1,167 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "blend.h"
+
+#if !defined(NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define BLEND_X86
+#include <immintrin.h>
+#elif !defined(NO_SIMD) && defined(__ARM_NEON) && BYTE_ORDER == LITTLE_ENDIAN
+#define BLEND_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*BlendRow)(uint32_t *dst, const uint32_t *src, int width);
+
+static void blend_row_c(uint32_t *dst, const uint32_t *src, int width)
+{
+    gRGB *d = (gRGB *)dst;
+    const gRGB *s = (const gRGB *)src;
+    while (width--)
+        (d++)->alpha_blend(*s++);
+}
+
+/*
+ * The vector versions work on 16 bit lanes: d * (256 - a) + s * a is
+ * d * 256 + (s - d) * a, never above 0xff00, so shifting it right by 8
+ * rounds down just like the signed >> 8 of the plain loop.
+ */
+#if defined(BLEND_X86)
+static void blend_row_sse2(uint32_t *dst, const uint32_t *src, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i amask = _mm_set1_epi32(0xFF000000);
+    const __m128i c256 = _mm_set1_epi16(256);
+    for (; width >= 4; width -= 4, src += 4, dst += 4)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)src);
+        __m128i as = _mm_and_si128(s, amask);
+        /* four transparent pixels leave dst as it is */
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(as, zero)) == 0xFFFF)
+            continue;
+        __m128i d = _mm_loadu_si128((const __m128i *)dst);
+        /* alpha of each pixel in all four lanes, the source alpha lane becomes 0xff */
+        __m128i alo = _mm_unpacklo_epi8(as, zero), ahi = _mm_unpackhi_epi8(as, zero);
+        alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(alo, 0xFF), 0xFF);
+        ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(ahi, 0xFF), 0xFF);
+        s = _mm_or_si128(s, amask);
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(c256, alo)),
+            _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), alo));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(c256, ahi)),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), ahi));
+        _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+    blend_row_c(dst, src, width);
+}
+
+__attribute__((target("avx2")))
+static void blend_row_avx2(uint32_t *dst, const uint32_t *src, int width)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i amask = _mm256_set1_epi32(0xFF000000);
+    const __m256i c256 = _mm256_set1_epi16(256);
+    for (; width >= 8; width -= 8, src += 8, dst += 8)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *)src);
+        __m256i as = _mm256_and_si256(s, amask);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(as, zero)) == -1)
+            continue;
+        __m256i d = _mm256_loadu_si256((const __m256i *)dst);
+        /* unpack and pack work per 128 bit half, the pixel order survives */
+        __m256i alo = _mm256_unpacklo_epi8(as, zero), ahi = _mm256_unpackhi_epi8(as, zero);
+        alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(alo, 0xFF), 0xFF);
+        ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(ahi, 0xFF), 0xFF);
+        s = _mm256_or_si256(s, amask);
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(c256, alo)),
+            _mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero), alo));
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(c256, ahi)),
+            _mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero), ahi));
+        _mm256_storeu_si256((__m256i *)dst, _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)));
+    }
+    blend_row_sse2(dst, src, width);
+}
+#elif defined(BLEND_NEON)
+/* d * 256 + s * a - d * a, wrapping in between is fine as the result fits */
+static inline uint8x8_t blend8(uint8x8_t d, uint8x8_t s, uint8x8_t a)
+{
+    uint16x8_t acc = vshll_n_u8(d, 8);
+    acc = vmlal_u8(acc, s, a);
+    acc = vmlsl_u8(acc, d, a);
+    return vshrn_n_u16(acc, 8);
+}
+
+static void blend_row_neon(uint32_t *dst, const uint32_t *src, int width)
+{
+    const uint8x8_t opaque = vdup_n_u8(0xFF);
+    for (; width >= 8; width -= 8, src += 8, dst += 8)
+    {
+        /* one register per channel, b g r a */
+        uint8x8x4_t s = vld4_u8((const uint8_t *)src);
+        if (!vget_lane_u64(vreinterpret_u64_u8(s.val[3]), 0))
+            continue;
+        uint8x8x4_t d = vld4_u8((const uint8_t *)dst);
+        d.val[0] = blend8(d.val[0], s.val[0], s.val[3]);
+        d.val[1] = blend8(d.val[1], s.val[1], s.val[3]);
+        d.val[2] = blend8(d.val[2], s.val[2], s.val[3]);
+        d.val[3] = blend8(d.val[3], opaque, s.val[3]);
+        vst4_u8((uint8_t *)dst, d);
+    }
+    blend_row_c(dst, src, width);
+}
+#endif
+
+static BlendRow selectRow()
+{
+#if defined(BLEND_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return blend_row_avx2;
+    return blend_row_sse2;
+#elif defined(BLEND_NEON)
+    return blend_row_neon;
+#else
+    return blend_row_c;
+#endif
+}
+
+static BlendRow blendRow()
+{
+    static const BlendRow row = selectRow();
+    return row;
+}
+
+void blend_32_to_32(gRGB *dst, const gRGB *src, int width)
+{
+    blendRow()((uint32_t *)dst, (const uint32_t *)src, width);
+}
+
+void blend_8i_to_32(gRGB *dst, const uint8_t *src, const uint32_t *pal, int width)
+{
+    /* expand a piece of the row, then blend it like a 32 bit one */
+    BlendRow row = blendRow();
+    uint32_t argb[64];
+    while (width > 0)
+    {
+        int n = width < 64 ? width : 64;
+        for (int x = 0; x < n; x++)
+            argb[x] = pal[src[x]];
+        row((uint32_t *)dst, argb, n);
+        dst += n;
+        src += n;
+        width -= n;
+    }
+}
@@ -0,0 +1,35 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _BLEND_H_
+#define _BLEND_H_
+
+#include <stdint.h>
+#include "upng.h"
+
+/*
+ * Alpha blending of pixel rows, every channel as gRGB::alpha_blend does it,
+ * d + ((s - d) * a >> 8), the alpha channel is blended towards 0xff.
+ * Several pixels are done at once with SSE2, AVX2 (if the cpu has it) or
+ * NEON, the results are the same as the plain loop. Build with -DNO_SIMD
+ * to use only the plain loop.
+ */
+void blend_32_to_32(gRGB *dst, const gRGB *src, int width);
+/* src are palette indices into pal, laid out as gLookup::argb */
+void blend_8i_to_32(gRGB *dst, const uint8_t *src, const uint32_t *pal, int width);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/stat.h>
+
+#include "decodepool.h"
+#include "imagecache.h"
+#include "imagedecoder.h"
+#include "surfacepool.h"
+#include "framearena.h"
+
+DecodePool::DecodePool(int threads)
+{
+    m_stop = false;
+    m_cache = NULL;
+    if (threads <= 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads <= 0)
+        threads = 2;
+    for (int i = 0; i < threads; i++)
+        m_workers.push_back(std::thread(&DecodePool::worker, this));
+}
+
+DecodePool::~DecodePool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stop = true;
+        m_work.notify_all();
+    }
+    for (size_t i = 0; i < m_workers.size(); i++)
+        m_workers[i].join();
+}
+
+void DecodePool::submit(const std::string &path, int first, int end)
+{
+    std::shared_ptr<Job> job(new Job);
+    job->path = path;
+    job->first = first > 0 ? first : 0;
+    job->end = end;
+    job->top = 0;
+    job->done = false;
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_queue.push_back(job);
+    m_order.push_back(job);
+    m_work.notify_one();
+}
+
+std::shared_ptr<gSurface> DecodePool::next(int *top)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (m_order.empty())
+        return std::shared_ptr<gSurface>();
+    std::shared_ptr<Job> job = m_order.front();
+    m_order.pop_front();
+    while (!job->done)
+        m_done.wait(lock);
+    if (top)
+        *top = job->top;
+    return job->result;
+}
+
+size_t DecodePool::pending()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_order.size();
+}
+
+void DecodePool::decode(Job &job, FrameArena &arena)
+{
+    struct stat st;
+    bool cached = m_cache && stat(job.path.c_str(), &st) == 0;
+
+    if (cached && (job.result = m_cache->find(job.path.c_str(), st.st_mtim, st.st_size)))
+        return;
+
+    FrameArena::Scope scope(arena);
+    std::unique_ptr<ImageDecoder> decoder(ImageDecoder::open(job.path.c_str(), &arena));
+    if (!decoder)
+        return;
+    int end = job.end < decoder->height() ? job.end : decoder->height();
+    if (job.first >= end)
+    {
+        /* nothing of it is needed */
+        job.result = SurfacePool::shared().get(decoder->width(), 0, decoder->bpp());
+        return;
+    }
+
+    if (decoder->interlaced() || (job.first == 0 && end == decoder->height()))
+    {
+        std::shared_ptr<gSurface> img = SurfacePool::shared().get(decoder->width(), decoder->height(), decoder->bpp());
+        if (!decoder->readImage(img.get()))
+            return;
+        decoder->getPalette(img.get());
+        if (cached)
+            m_cache->insert(job.path.c_str(), st.st_mtim, st.st_size, img);
+        job.result = img;
+        return;
+    }
+
+    /* a cut out, decoding stops after the last row needed */
+    std::shared_ptr<gSurface> img = SurfacePool::shared().get(decoder->width(), end - job.first, decoder->bpp());
+    for (int y = 0; y < job.first; y++)
+        if (!decoder->readRows((unsigned char *)img->data, img->stride, 1))
+            return;
+    if (!decoder->readRows((unsigned char *)img->data, img->stride, end - job.first))
+        return;
+    decoder->getPalette(img.get());
+    job.top = job.first;
+    job.result = img;
+}
+
+void DecodePool::worker()
+{
+    FrameArena arena; /* libpng state and row buffers of this thread */
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (true)
+    {
+        while (!m_stop && m_queue.empty())
+            m_work.wait(lock);
+        if (m_stop)
+            break;
+        std::shared_ptr<Job> job = m_queue.front();
+        m_queue.pop_front();
+
+        lock.unlock();
+        decode(*job, arena);
+        lock.lock();
+
+        job->done = true;
+        m_done.notify_all();
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DECODEPOOL_H_
+#define _DECODEPOOL_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "upng.h"
+
+class ImageCache;
+class FrameArena;
+
+/*
+ * Decodes images on a few worker threads, each with its own libpng state.
+ * Images are decoded in any order but handed out in the order they were
+ * submitted, so the caller can draw the first one while the rest is still
+ * being decoded.
+ */
+class DecodePool
+{
+private:
+    struct Job
+    {
+        std::string path;
+        int first, end; /* rows wanted */
+        std::shared_ptr<gSurface> result;
+        int top; /* source row of the first row in result */
+        bool done;
+    };
+
+    std::vector<std::thread> m_workers;
+    std::deque<std::shared_ptr<Job> > m_queue; /* not started yet */
+    std::deque<std::shared_ptr<Job> > m_order; /* not handed out yet */
+    std::mutex m_lock;
+    std::condition_variable m_work, m_done;
+    bool m_stop;
+    ImageCache *m_cache;
+
+    void worker();
+    void decode(Job &job, FrameArena &arena);
+
+public:
+    /* 0 threads uses one per cpu */
+    DecodePool(int threads = 0);
+    ~DecodePool();
+
+    /* shared decoded images, not owned */
+    void setCache(ImageCache *cache) { m_cache = cache; }
+    /* only rows first .. end-1 are needed, the rest may be left out */
+    void submit(const std::string &path, int first = 0, int end = 0x7fffffff);
+    /*
+     * the oldest image not handed out yet, waits for it, NULL if it couldn't
+     * be decoded. top is the image row the surface starts with.
+     */
+    std::shared_ptr<gSurface> next(int *top = NULL);
+    size_t pending();
+};
+
+#endif
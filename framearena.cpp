@@ -0,0 +1,83 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+
+#include "framearena.h"
+
+/* new[] only guarantees 8 bytes on 32 bit targets */
+static unsigned char *alignedBlock(size_t bytes)
+{
+    void *p;
+    if (posix_memalign(&p, 16, bytes))
+        return NULL;
+    return (unsigned char *)p;
+}
+
+FrameArena::FrameArena()
+{
+    m_block = NULL;
+    m_size = m_used = 0;
+    m_extra = m_peak = 0;
+    m_depth = 0;
+}
+
+FrameArena::~FrameArena()
+{
+    for (size_t i = 0; i < m_overflow.size(); i++)
+        free(m_overflow[i]);
+    free(m_block);
+}
+
+void *FrameArena::alloc(size_t bytes)
+{
+    void *p;
+    bytes = (bytes + 15) & ~(size_t)15;
+    if (m_used + bytes <= m_size)
+    {
+        p = m_block + m_used;
+        m_used += bytes;
+    }
+    else
+    {
+        /* the block stays where it is, earlier allocations point into it */
+        m_overflow.push_back(alignedBlock(bytes));
+        p = m_overflow.back();
+        m_extra += bytes;
+    }
+    if (m_used + m_extra > m_peak)
+        m_peak = m_used + m_extra;
+    return p;
+}
+
+void FrameArena::release(size_t mark)
+{
+    m_used = mark;
+    if (m_depth || m_overflow.empty())
+        return;
+
+    /* end of the frame, make the block big enough for the next one */
+    for (size_t i = 0; i < m_overflow.size(); i++)
+        free(m_overflow[i]);
+    m_overflow.clear();
+    free(m_block);
+    m_size = (m_peak + 4095) & ~(size_t)4095;
+    m_block = alignedBlock(m_size);
+    if (!m_block)
+        m_size = 0;
+    m_extra = 0;
+}
@@ -0,0 +1,66 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _FRAMEARENA_H_
+#define _FRAMEARENA_H_
+
+#include <stddef.h>
+#include <vector>
+
+/*
+ * Scratch memory for the temporary arrays of one frame. Allocations are
+ * taken from one block and dropped all at once when the outermost Scope
+ * ends; if the block was too small, it is grown to what the frame needed,
+ * so later frames of the same kind allocate nothing.
+ */
+class FrameArena
+{
+private:
+    unsigned char *m_block;
+    size_t m_size, m_used;
+    std::vector<unsigned char *> m_overflow; /* what didn't fit this frame */
+    size_t m_extra, m_peak;
+    int m_depth;
+
+    void release(size_t mark);
+
+public:
+    FrameArena();
+    ~FrameArena();
+
+    /* 16 byte aligned, valid until the Scope it was taken in ends */
+    void *alloc(size_t bytes);
+    template <class T> T *alloc(size_t count) { return (T *)alloc(count * sizeof(T)); }
+
+    class Scope
+    {
+    private:
+        FrameArena &m_arena;
+        size_t m_mark;
+        Scope(const Scope &);
+        Scope &operator=(const Scope &);
+    public:
+        Scope(FrameArena &arena): m_arena(arena), m_mark(arena.m_used) { arena.m_depth++; }
+        ~Scope() { m_arena.m_depth--; m_arena.release(m_mark); }
+    };
+
+private:
+    FrameArena(const FrameArena &);
+    FrameArena &operator=(const FrameArena &);
+};
+
+#endif
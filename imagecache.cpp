@@ -0,0 +1,89 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "imagecache.h"
+
+ImageCache::ImageCache(size_t budget)
+{
+    m_budget = budget;
+    m_used = 0;
+    m_hits = m_misses = 0;
+}
+
+void ImageCache::remove(List::iterator it)
+{
+    m_used -= it->bytes;
+    m_index.erase(it->path);
+    m_lru.erase(it);
+}
+
+/* drop the least recently used entries until keep more bytes fit */
+void ImageCache::evict(size_t keep)
+{
+    while (!m_lru.empty() && m_used + keep > m_budget)
+        remove(--m_lru.end());
+}
+
+std::shared_ptr<gSurface> ImageCache::find(const char *path, const struct timespec &mtime, off_t size)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    std::map<std::string, List::iterator>::iterator i = m_index.find(path);
+    if (i != m_index.end())
+    {
+        List::iterator it = i->second;
+        if (it->size == size && it->mtime.tv_sec == mtime.tv_sec && it->mtime.tv_nsec == mtime.tv_nsec)
+        {
+            m_lru.splice(m_lru.begin(), m_lru, it);
+            m_hits++;
+            return it->surface;
+        }
+        remove(it);
+    }
+    m_misses++;
+    return std::shared_ptr<gSurface>();
+}
+
+void ImageCache::insert(const char *path, const struct timespec &mtime, off_t size, const std::shared_ptr<gSurface> &surface)
+{
+    size_t bytes = surface->y * surface->stride + surface->clut.colors * sizeof(gRGB)
+        + (surface->clut.lookup ? sizeof(gLookup) : 0);
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (bytes > m_budget)
+        return;
+    std::map<std::string, List::iterator>::iterator i = m_index.find(path);
+    if (i != m_index.end())
+        remove(i->second);
+    evict(bytes);
+
+    Entry e;
+    e.path = path;
+    e.mtime = mtime;
+    e.size = size;
+    e.surface = surface;
+    e.bytes = bytes;
+    m_lru.push_front(e);
+    m_index[e.path] = m_lru.begin();
+    m_used += bytes;
+}
+
+void ImageCache::setBudget(size_t budget)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_budget = budget;
+    evict(0);
+}
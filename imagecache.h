@@ -0,0 +1,74 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _IMAGECACHE_H_
+#define _IMAGECACHE_H_
+
+#include <time.h>
+#include <sys/types.h>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "upng.h"
+
+/*
+ * Decoded images, most recently used first. An entry is only valid while
+ * the file keeps its mtime and size. Surfaces are shared, an entry evicted
+ * while a blit still uses it stays alive until that blit drops it.
+ */
+class ImageCache
+{
+private:
+    struct Entry
+    {
+        std::string path;
+        struct timespec mtime;
+        off_t size;
+        std::shared_ptr<gSurface> surface;
+        size_t bytes;
+    };
+    typedef std::list<Entry> List;
+
+    List m_lru;
+    std::map<std::string, List::iterator> m_index;
+    std::mutex m_lock;
+    size_t m_budget;
+    size_t m_used;
+    std::atomic<unsigned int> m_hits, m_misses;
+
+    void evict(size_t keep);
+    void remove(List::iterator it);
+
+public:
+    /* budget in bytes of decoded pixel data, 0 caches nothing */
+    ImageCache(size_t budget);
+
+    /* the decoded image for path, NULL if it is not cached or has changed */
+    std::shared_ptr<gSurface> find(const char *path, const struct timespec &mtime, off_t size);
+    void insert(const char *path, const struct timespec &mtime, off_t size, const std::shared_ptr<gSurface> &surface);
+    void setBudget(size_t budget);
+
+    unsigned int hits() const { return m_hits; }
+    unsigned int misses() const { return m_misses; }
+    size_t used() const { return m_used; }
+    size_t budget() const { return m_budget; }
+};
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "imagedecoder.h"
+#include "pngdecoder.h"
+#include "bitmapdecoder.h"
+
+/* a dump has no header to tell its size, it is given once for all images */
+static int s_dumpWidth = 0, s_dumpHeight = 0, s_dumpBpp = 0;
+
+void ImageDecoder::setDump(int width, int height, int bpp)
+{
+    s_dumpWidth = width;
+    s_dumpHeight = height;
+    s_dumpBpp = bpp;
+}
+
+/* a file or a stream of unknown size (0) is a dump if it has the size of one */
+static bool isDump(off_t size)
+{
+    return s_dumpBpp && (!size || size == (off_t)s_dumpWidth * s_dumpHeight * (s_dumpBpp >> 3));
+}
+
+/* takes fp over, only its first byte is looked at so pipes work as well */
+ImageDecoder *ImageDecoder::open(FILE *fp, off_t size, FrameArena *arena)
+{
+    int c = getc(fp);
+    if (c == EOF || ungetc(c, fp) == EOF)
+    {
+        printf("[uPNG] couldn't read\n");
+        fclose(fp);
+        return NULL;
+    }
+
+    if (isDump(size))
+    {
+        BitmapDecoder *decoder = new BitmapDecoder(s_dumpWidth, s_dumpHeight, s_dumpBpp);
+        decoder->setArena(arena);
+        if (decoder->open(fp))
+            return decoder;
+        delete decoder;
+    }
+    else if (c == 0x89)
+    {
+        PNGDecoder *decoder = new PNGDecoder();
+        decoder->setArena(arena);
+        if (decoder->open(fp))
+            return decoder;
+        delete decoder;
+    }
+    else if (c == 'P' || c == 'B')
+    {
+        BitmapDecoder *decoder = new BitmapDecoder();
+        decoder->setArena(arena);
+        if (decoder->open(fp))
+            return decoder;
+        delete decoder;
+    }
+    else
+    {
+        printf("[uPNG] unknown image format\n");
+        fclose(fp);
+    }
+    return NULL;
+}
+
+ImageDecoder *ImageDecoder::open(const char *filename, FrameArena *arena)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        printf("[uPNG] couldn't open %s\n", filename );
+        return NULL;
+    }
+    struct stat st;
+    return open(fp, fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0, arena);
+}
+
+ImageDecoder *ImageDecoder::openFd(int fd, FrameArena *arena)
+{
+    int copy = dup(fd);
+    FILE *fp;
+    if (copy < 0 || !(fp = fdopen(copy, "rb")))
+    {
+        printf("[uPNG] couldn't open fd %d (%m)\n", fd);
+        if (copy >= 0)
+            close(copy);
+        return NULL;
+    }
+    return open(fp, 0, arena);
+}
+
+ImageDecoder *ImageDecoder::open(const void *data, size_t len, FrameArena *arena)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    if (!len)
+        return NULL;
+
+    if (isDump(len))
+    {
+        BitmapDecoder *decoder = new BitmapDecoder(s_dumpWidth, s_dumpHeight, s_dumpBpp);
+        decoder->setArena(arena);
+        if (decoder->open(data, len))
+            return decoder;
+        delete decoder;
+    }
+    else if (p[0] == 0x89)
+    {
+        PNGDecoder *decoder = new PNGDecoder();
+        decoder->setArena(arena);
+        if (decoder->open(data, len))
+            return decoder;
+        delete decoder;
+    }
+    else if (p[0] == 'P' || p[0] == 'B')
+    {
+        BitmapDecoder *decoder = new BitmapDecoder();
+        decoder->setArena(arena);
+        if (decoder->open(data, len))
+            return decoder;
+        delete decoder;
+    }
+    else
+        printf("[uPNG] unknown image format\n");
+    return NULL;
+}
@@ -0,0 +1,71 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _IMAGEDECODER_H_
+#define _IMAGEDECODER_H_
+
+#include <stdio.h>
+#include "upng.h"
+
+class FrameArena;
+
+/*
+ * Hands out an image as 8bpp (palette or gray) or 32bpp bgra rows, the
+ * layout uPNG blits from, either all at once or a few rows at a time.
+ */
+class ImageDecoder
+{
+protected:
+    int m_width, m_height, m_bpp;
+    bool m_interlaced;
+    FrameArena *m_arena;
+
+    ImageDecoder(): m_width(0), m_height(0), m_bpp(0), m_interlaced(false), m_arena(NULL) {}
+    static ImageDecoder *open(FILE *fp, off_t size, FrameArena *arena);
+
+public:
+    virtual ~ImageDecoder() {}
+
+    /*
+     * a decoder for the format the first bytes name, NULL if there is none.
+     * Data has to stay valid while decoding, fd is left open. The decoder
+     * takes its working memory from arena if there is one, the arena has
+     * to outlive it.
+     */
+    static ImageDecoder *open(const char *filename, FrameArena *arena = NULL);
+    static ImageDecoder *open(const void *data, size_t len, FrameArena *arena = NULL);
+    static ImageDecoder *openFd(int fd, FrameArena *arena = NULL);
+    /* headerless pixel dumps are width x height, bpp 32 (bgra) or 8 (gray), 0 for none */
+    static void setDump(int width, int height, int bpp);
+    /* working memory for a decoder opened directly, before open() */
+    void setArena(FrameArena *arena) { m_arena = arena; }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    int bpp() const { return m_bpp; }
+    /* the rows can't be read in order, only readImage works */
+    bool interlaced() const { return m_interlaced; }
+
+    /* set up the palette of surface, none for gray and 32bpp images */
+    virtual void getPalette(gUnmanagedSurface *surface) = 0;
+    /* decode the whole image into surface, which has to be width x height x bpp */
+    virtual bool readImage(gUnmanagedSurface *surface) = 0;
+    /* decode the next count rows, not for interlaced images */
+    virtual bool readRows(unsigned char *data, int stride, int count) = 0;
+};
+
+#endif
@@ -18,9 +18,19 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
 #include <string>
+#include <vector>
 
 #include "vfd.h"
+#include "vfdserver.h"
+#include "slideshow.h"
+#include "animation.h"
+#include "decodepool.h"
+#include "imagedecoder.h"
 
 void usage()
 {
@@ -28,14 +38,97 @@ void usage()
 	std::string message = "Usage: displayvfd [option] arg .. &\n";
 	message += "Options : \n";
 //    message += "    -p [PNG_FILE_PATH] -x [posX] -y [posY]\n";
-    message += "	-p [PNG_FILE_PATH]\n";
+    message += "	-p [PNG_FILE_PATH] : - reads the png from stdin, binary PPM/PGM and 32 bit BMP work as well\n";
+    message += "	                     repeat -p to draw several images in order, decoded in parallel,\n";
+    message += "	                     each at the -x/-y given before it\n";
+    message += "	-R [WxHxBPP] : images of W*H*BPP/8 bytes and images from stdin are headerless pixel\n";
+    message += "	               dumps, BPP 32 (bgra) or 8 (gray)\n";
+    message += "	-z : scale the image to fit the panel, keeping its aspect ratio\n";
+    message += "	-Q [FILTER] : scaling for -z, nearest (default), bilinear or area (averaging, for big images)\n";
+    message += "	-C [OUT_FILE] : store the image from -p in the panel layout instead of showing it,\n";
+    message += "	                -p OUT_FILE shows it later without decoding\n";
+    message += "	-b [BRIGHTNESS] : panel brightness (default 102)\n";
+    message += "	-d : run as daemon and keep the display open\n";
+    message += "	-s [SOCKET_PATH] : daemon socket (default " VFD_SOCKET_PATH ")\n";
+    message += "	-q : stop a running daemon\n";
+    message += "	-i : print the frame counters of a running daemon\n";
+    message += "	-F [WxHxBPP[:LCD_TYPE[:LOG]]] : use a fake panel instead of the device\n";
+    message += "	-r [ROOT] : prefix for the device and /proc paths\n";
+    message += "	-P : partial updates, write only the changed area if the driver can seek,\n";
+    message += "	     only for drivers whose write honours the file offset\n";
+    message += "	-a : write to the panel from a separate thread (always on with -d)\n";
+    message += "	-f [FPS] : at most FPS panel updates per second, newer frames win\n";
+    message += "	-n [COUNT] : draw COUNT times and print the time per frame\n";
+    message += "	-c [KB] : memory for decoded images kept for reuse (default 4096, 0 off)\n";
+    message += "	-S [MS] [PNG|DIR] .. : slideshow, show every image for MS milliseconds\n";
+    message += "	-l [LOOPS] : slideshow passes over the list (default 0, endless),\n";
+    message += "	             plays of an animated png (default 0, as stored in the file)\n";
     printf("%s\n",message.c_str());
 }
 
+static bool readAll(int fd, std::string &out)
+{
+    char buf[65536];
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof(buf))) != 0)
+    {
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        out.append(buf, r);
+    }
+    return true;
+}
+
+struct Layer
+{
+    std::string path;
+    int x, y;
+};
+
+/* decode all layers at once, draw them bottom up as they come in */
+static int drawLayers(VFD *vfd, DecodePool &pool, const std::vector<Layer> &layers)
+{
+    int res = 0;
+    bool scaled = vfd->blitFlags() & uPNG::blitScale;
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        /* unscaled, the rows off the panel need not be decoded */
+        if (scaled)
+            pool.submit(layers[i].path);
+        else
+            pool.submit(layers[i].path, -layers[i].y, vfd->size().height() - layers[i].y);
+    }
+    vfd->clear();
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        int top;
+        std::shared_ptr<gSurface> img = pool.next(&top);
+        if (!img || vfd->drawImage(img.get(), layers[i].x, layers[i].y + top) != 0)
+        {
+            printf("[VFD] couldn't draw %s\n", layers[i].path.c_str());
+            res = -1;
+        }
+    }
+    vfd->Write();
+    return res;
+}
+
 int main(int argc, char **argv) {
 
 	std::string  fileName;
-	int x, y, opt;
+	std::vector<Layer> layers;
+	std::string  socketPath = VFD_SOCKET_PATH;
+	const char *fakeSpec = NULL;
+	const char *root = NULL;
+	const char *compileTo = NULL;
+	const char *dumpSpec = NULL;
+	const char *filterName = NULL;
+	bool daemon = false, quit = false, partial = false, stats = false, async = false, fit = false;
+	int x, y, opt, count = 1, fps = 0, brightness = -1, interval = -1, loops = 0, cacheKB = 4096;
 
 	x = 0;
 	y = 0;
@@ -46,31 +139,287 @@ int main(int argc, char **argv) {
 		usage(); return 0;
 	}
 
-	while( ( opt = getopt( argc, argv, "p:x:y:")) != -1 )
+	while( ( opt = getopt( argc, argv, "p:x:y:ds:qiF:r:n:Paf:b:S:l:c:C:zR:Q:")) != -1 )
 	{
 		switch(opt)
 		{
 			case 'p':
+			{
+				Layer l = { optarg, x, y };
+				layers.push_back(l);
 				fileName = optarg; break;
+			}
 			case 'x':
 				x = atoi(optarg); break;
 			case 'y':
 				y = atoi(optarg); break;
+			case 'd':
+				daemon = true; break;
+			case 's':
+				socketPath = optarg; break;
+			case 'q':
+				quit = true; break;
+			case 'i':
+				stats = true; break;
+			case 'F':
+				fakeSpec = optarg; break;
+			case 'r':
+				root = optarg; break;
+			case 'n':
+				count = atoi(optarg); break;
+			case 'P':
+				partial = true; break;
+			case 'a':
+				async = true; break;
+			case 'f':
+				fps = atoi(optarg); break;
+			case 'b':
+				brightness = atoi(optarg); break;
+			case 'S':
+				/* without a pause the show would redraw as fast as the panel takes it */
+				interval = atoi(optarg);
+				if (interval <= 0)
+				{
+					printf("[VFD] slideshow interval must be at least 1 ms\n");
+					return 1;
+				}
+				break;
+			case 'l':
+				loops = atoi(optarg); break;
+			case 'c':
+				cacheKB = atoi(optarg); break;
+			case 'C':
+				compileTo = optarg; break;
+			case 'z':
+				fit = true; break;
+			case 'R':
+				dumpSpec = optarg; break;
+			case 'Q':
+				filterName = optarg; break;
 			default:
 				usage(); return 0; break;
 		}
 	}
 
-    int res = -1;
+    if (dumpSpec)
+    {
+        int w, h, bpp;
+        if (sscanf(dumpSpec, "%dx%dx%d", &w, &h, &bpp) != 3 || w <= 0 || h <= 0 || (bpp != 8 && bpp != 32))
+        {
+            printf("[VFD] invalid pixel dump size '%s'\n", dumpSpec);
+            return 1;
+        }
+        ImageDecoder::setDump(w, h, bpp);
+    }
+
+    int filter = 0;
+    if (filterName)
+    {
+        if (!strcmp(filterName, "bilinear"))
+            filter = uPNG::blitScaleBilinear;
+        else if (!strcmp(filterName, "area"))
+            filter = uPNG::blitScaleArea;
+        else if (strcmp(filterName, "nearest"))
+        {
+            printf("[VFD] unknown scaling filter '%s'\n", filterName);
+            return 1;
+        }
+    }
+
+    /*
+     * a daemon would not know the dump size, and only takes a position and
+     * an image: drawing options and animations are handled here
+     */
+    std::string input;
+    bool inputRead = false;
+    bool drawOptions = fit || filterName || count > 1 || partial || async || fps || cacheKB != 4096;
+    bool animated = fileName.size() != 0 && fileName != "-" && APNG::isAnimated(fileName.c_str());
+    if (!daemon && !fakeSpec && !root && interval < 0 && !compileTo && !dumpSpec && layers.size() <= 1 && !drawOptions && !animated)
+    {
+        /* the whole image is at hand before the daemon is bothered with it */
+        if (fileName == "-" && !quit && !stats)
+        {
+            if (!readAll(0, input))
+                return 1;
+            inputRead = true;
+        }
+
+        /* hand the request to a running daemon, draw ourselves otherwise */
+        VFDClient client;
+        if (client.connect(socketPath.c_str()))
+        {
+            if (quit)
+                return client.command("quit") == 0 ? 0 : 1;
+            if (stats)
+            {
+                std::string info;
+                int ret = client.command("stats", &info);
+                printf("%s\n", info.c_str());
+                return ret == 0 ? 0 : 1;
+            }
+            int ret = 0;
+            if (brightness >= 0)
+            {
+                char cmd[32];
+                snprintf(cmd, sizeof(cmd), "brightness %d", brightness);
+                if (client.command(cmd) != 0)
+                    ret = 1;
+            }
+            if (fileName == "-")
+            {
+                char cmd[64];
+                snprintf(cmd, sizeof(cmd), "pngdata %d %d %zu", x, y, input.size());
+                return client.command(cmd, NULL, &input) == 0 ? ret : 1;
+            }
+            if (fileName.size() != 0)
+            {
+                char path[PATH_MAX];
+                if (realpath(fileName.c_str(), path))
+                    fileName = path;
+                char cmd[64];
+                snprintf(cmd, sizeof(cmd), "png %d %d ", x, y);
+                return client.command(cmd + fileName) == 0 ? ret : 1;
+            }
+            return ret;
+        }
+        if (quit || stats)
+        {
+            printf("[VFD] no daemon running on %s\n", socketPath.c_str());
+            return 1;
+        }
+    }
+
+    VFDBackend *backend = NULL;
+    if (fakeSpec)
+    {
+        backend = VFDFakePanel::create(fakeSpec);
+        if (!backend)
+        {
+            printf("[VFD] invalid fake panel '%s'\n", fakeSpec);
+            return 1;
+        }
+    }
+    else if (root)
+    {
+        VFDPaths paths;
+        paths.setRoot(root);
+        backend = new VFDDevice(paths);
+    }
+
+    int res = 0;
+    ImageCache cache(cacheKB > 0 ? (size_t)cacheKB * 1024 : 0);
     VFD * vfd;
-    vfd = new VFD();
-    if (fileName.size() != 0)
+    vfd = new VFD(backend);
+    if (cacheKB > 0)
+        vfd->setImageCache(&cache);
+    vfd->setPartialUpdates(partial);
+    vfd->setScaleToFit(fit, filter);
+    vfd->setAsync(async || daemon);
+    vfd->setMaxRate(fps);
+    if (brightness >= 0)
+        res = vfd->setLCDBrightness(brightness);
+    if (compileTo)
+    {
+        if (fileName.size() == 0)
+        {
+            printf("[VFD] -C needs an image (-p)\n");
+            res = -1;
+        }
+        else
+            res = vfd->compile(fileName.c_str(), x, y, compileTo);
+    }
+    else if (interval >= 0)
+    {
+        VFDSlideshow show(vfd, interval);
+        show.setPosition(x, y);
+        show.setLoops(loops);
+        if (cacheKB > 0)
+            show.setImageCache(&cache);
+        for (size_t i = 0; i < layers.size(); i++)
+            show.add(layers[i].path.c_str());
+        for (int i = optind; i < argc; i++)
+            show.add(argv[i]);
+        if (show.count() == 0)
+        {
+            printf("[VFD] no images for the slideshow\n");
+            res = -1;
+        }
+        else
+            res = show.run();
+    }
+    else if (fileName == "-")
+    {
+        /* a pipe can be read only once, the benchmark needs a copy */
+        if (count <= 1 && !inputRead)
+            res = vfd->displayPNGFd(0, x, y);
+        else if (inputRead || readAll(0, input))
+        {
+            for (int i = 0; i < count; i++)
+            {
+                vfd->clear();
+                res = vfd->displayPNG(input.data(), input.size(), x, y);
+            }
+        }
+        vfd->flush();
+    }
+    else if (layers.size() <= 1 && animated)
+    {
+        VFDAnimation anim(vfd);
+        anim.setPosition(x, y);
+        anim.setPlays(loops);
+        if (anim.open(fileName.c_str()))
+            res = anim.run();
+        else
+        {
+            printf("[VFD] couldn't load the animation %s\n", fileName.c_str());
+            res = -1;
+        }
+    }
+    else if (fileName.size() != 0)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool raw = VFD::isRaw(fileName.c_str());
+        DecodePool *pool = NULL;
+        if (layers.size() > 1)
+        {
+            pool = new DecodePool();
+            if (cacheKB > 0)
+                pool->setCache(&cache);
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (pool)
+            {
+                res = drawLayers(vfd, *pool, layers);
+                continue;
+            }
+            if (raw)
+            {
+                res = vfd->displayRaw(fileName.c_str());
+                continue;
+            }
+            vfd->clear();
+            res = vfd->displayPNG(fileName.c_str(), x, y);
+        }
+        delete pool;
+        vfd->flush();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (count > 1)
+        {
+            double us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+            printf("[VFD] %d frames, %.1f us per frame, %u written, %u skipped, %u merged, %u cache hits, %u misses\n", count, us / count, vfd->writtenFrames(), vfd->skippedFrames(), vfd->mergedFrames(), cache.hits(), cache.misses());
+        }
+    }
+    if (daemon)
     {
-        res = vfd->displayPNG(fileName.c_str(), x, y);
+        VFDServer server(vfd, socketPath.c_str());
+        server.setMaxRate(fps);
+        res = server.run();
     }
     delete vfd;
 
-	return 0;
+	return res != 0 ? 1 : 0;
 
 }
 
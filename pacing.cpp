@@ -0,0 +1,56 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <signal.h>
+#include <cstring>
+
+#include "pacing.h"
+
+static volatile sig_atomic_t s_stop = 0;
+
+static void sigHandler(int)
+{
+    s_stop = 1;
+}
+
+void catchStop()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigHandler;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+}
+
+bool stopRequested()
+{
+    return s_stop;
+}
+
+void waitUntil(struct timespec &due, int ms)
+{
+    due.tv_sec += ms / 1000;
+    due.tv_nsec += (ms % 1000) * 1000000L;
+    if (due.tv_nsec >= 1000000000L)
+    {
+        due.tv_sec++;
+        due.tv_nsec -= 1000000000L;
+    }
+    while (!s_stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+        ;
+}
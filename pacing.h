@@ -0,0 +1,35 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PACING_H_
+#define _PACING_H_
+
+#include <time.h>
+
+/*
+ * Shared by the daemon, the slideshow and animations: they run until
+ * SIGTERM or SIGINT, and show frames at deadlines that don't drift.
+ */
+
+/* catch SIGTERM and SIGINT without SA_RESTART, so blocking calls return */
+void catchStop();
+/* true once SIGTERM or SIGINT came in */
+bool stopRequested();
+/* move due on by ms and sleep until then, returns early on a stop */
+void waitUntil(struct timespec &due, int ms);
+
+#endif
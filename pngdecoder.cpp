@@ -0,0 +1,267 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+
+#include "pngdecoder.h"
+#include "framearena.h"
+
+PNGDecoder::PNGDecoder()
+{
+    m_fp = NULL;
+    m_data = NULL;
+    m_len = m_pos = 0;
+    m_png = NULL;
+    m_info = m_end = NULL;
+    m_palette = false;
+    m_row = 0;
+    m_passes = 1;
+}
+
+PNGDecoder::~PNGDecoder()
+{
+    if (m_png)
+        png_destroy_read_struct(&m_png, m_info ? &m_info : (png_infopp)NULL, m_end ? &m_end : (png_infopp)NULL);
+    if (m_fp)
+        fclose(m_fp);
+}
+
+bool PNGDecoder::open(const char *filename)
+{
+    m_fp = fopen(filename, "rb");
+    if (!m_fp)
+    {
+        printf("[uPNG] couldn't open %s\n", filename );
+        return false;
+    }
+    return start();
+}
+
+bool PNGDecoder::open(FILE *fp)
+{
+    m_fp = fp;
+    return start();
+}
+
+bool PNGDecoder::open(const void *data, size_t len)
+{
+    m_data = (const unsigned char *)data;
+    m_len = len;
+    m_pos = 0;
+    return start();
+}
+
+void PNGDecoder::readMemory(png_structp png, png_bytep out, png_size_t len)
+{
+    PNGDecoder *self = (PNGDecoder *)png_get_io_ptr(png);
+    if (len > self->m_len - self->m_pos)
+        png_error(png, "read past the end of the data");
+    memcpy(out, self->m_data + self->m_pos, len);
+    self->m_pos += len;
+}
+
+png_voidp PNGDecoder::arenaAlloc(png_structp png, png_alloc_size_t size)
+{
+    return ((FrameArena *)png_get_mem_ptr(png))->alloc(size);
+}
+
+/* the arena drops everything at the end of the frame */
+void PNGDecoder::arenaFree(png_structp png, png_voidp ptr)
+{
+}
+
+bool PNGDecoder::start()
+{
+    unsigned char header[8];
+
+    if (m_fp ? !fread(header, 8, 1, m_fp) : m_len < 8)
+    {
+        printf("[uPNG] couldn't read\n");
+        return false;
+    }
+    if (!m_fp)
+    {
+        memcpy(header, m_data, 8);
+        m_pos = 8;
+    }
+    if (png_sig_cmp(header, 0, 8))
+        return false;
+
+    if (m_arena)
+        m_png = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, 0, 0, 0, m_arena, arenaAlloc, arenaFree);
+    else
+        m_png = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+    if (!m_png)
+    {
+        printf("[uPNG] failed to create read struct\n");
+        return false;
+    }
+    m_info = png_create_info_struct(m_png);
+    if (!m_info)
+    {
+        printf("[uPNG] failed to create info struct\n");
+        return false;
+    }
+    m_end = png_create_info_struct(m_png);
+    if (!m_end)
+    {
+        printf("[uPNG] failed to create end info struct\n");
+        return false;
+    }
+    if (setjmp(png_jmpbuf(m_png)))
+    {
+        printf("[uPNG] png setjump failed or activated\n");
+        return false;
+    }
+    if (m_fp)
+        png_init_io(m_png, m_fp);
+    else
+        png_set_read_fn(m_png, this, readMemory);
+    png_set_sig_bytes(m_png, 8);
+    png_read_info(m_png, m_info);
+
+    png_uint_32 width, height;
+    int bit_depth;
+    int color_type;
+    int interlace_type;
+    int channels;
+    int trns;
+
+    png_get_IHDR(m_png, m_info, &width, &height, &bit_depth, &color_type, &interlace_type, 0, 0);
+    channels = png_get_channels(m_png, m_info);
+    trns = png_get_valid(m_png, m_info, PNG_INFO_tRNS);
+
+    /*
+     * gPixmaps use 8 bits per channel. rgb pixmaps are stored as abgr.
+     * So convert 1,2 and 4 bpc to 8bpc images that enigma can blit
+     * so add 'empty' alpha channel
+     * Expand G+tRNS to GA, RGB+tRNS to RGBA
+     */
+    if (bit_depth == 16)
+        png_set_strip_16(m_png);
+    if (bit_depth < 8)
+        png_set_packing (m_png);
+
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8(m_png);
+    if (color_type == PNG_COLOR_TYPE_GRAY && trns)
+        png_set_tRNS_to_alpha(m_png);
+    if ((color_type == PNG_COLOR_TYPE_GRAY && trns) || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+        png_set_gray_to_rgb(m_png);
+        png_set_bgr(m_png);
+    }
+
+    if (color_type == PNG_COLOR_TYPE_RGB) {
+        if (trns)
+            png_set_tRNS_to_alpha(m_png);
+        else
+            png_set_add_alpha(m_png, 255, PNG_FILLER_AFTER);
+    }
+
+    if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_RGB_ALPHA)
+        png_set_bgr(m_png);
+
+    // Update the info structures after the transformations take effect
+    m_interlaced = interlace_type != PNG_INTERLACE_NONE;
+    if (m_interlaced)
+        m_passes = png_set_interlace_handling(m_png);  // needed before read_update_info()
+    png_read_update_info (m_png, m_info);
+    png_get_IHDR(m_png, m_info, &width, &height, &bit_depth, &color_type, 0, 0, 0);
+    channels = png_get_channels(m_png, m_info);
+
+    m_width = width;
+    m_height = height;
+    m_bpp = bit_depth * channels;
+    m_palette = color_type == PNG_COLOR_TYPE_PALETTE;
+    return true;
+}
+
+void PNGDecoder::getPalette(gUnmanagedSurface *surface)
+{
+    if (!m_palette)
+        return;
+
+    int num_palette = -1, num_trans = -1;
+    if (png_get_valid(m_png, m_info, PNG_INFO_PLTE)) {
+        png_color *palette;
+        png_get_PLTE(m_png, m_info, &palette, &num_palette);
+        if (num_palette) {
+            surface->clut.data = new gRGB[num_palette];
+            surface->clut.colors = num_palette;
+
+            for (int i = 0; i < num_palette; i++) {
+                surface->clut.data[i].a = 0;
+                surface->clut.data[i].r = palette[i].red;
+                surface->clut.data[i].g = palette[i].green;
+                surface->clut.data[i].b = palette[i].blue;
+            }
+
+            if (png_get_valid(m_png, m_info, PNG_INFO_tRNS)) {
+                png_byte *trans;
+                png_get_tRNS(m_png, m_info, &trans, &num_trans, 0);
+                for (int i = 0; i < num_trans; i++)
+                    surface->clut.data[i].a = 255 - trans[i];
+                for (int i = num_trans; i < num_palette; i++)
+                    surface->clut.data[i].a = 0;
+            }
+
+        }
+        else {
+            surface->clut.data = 0;
+            surface->clut.colors = num_palette;
+        }
+    }
+    else {
+        surface->clut.data = 0;
+        surface->clut.colors = 0;
+    }
+    surface->clut.start = 0;
+    surface->clut.lookup.reset(surface->clut.data ? new gLookup(surface->clut.data, surface->clut.colors) : NULL);
+}
+
+bool PNGDecoder::readImage(gUnmanagedSurface *surface)
+{
+    if (setjmp(png_jmpbuf(m_png)))
+    {
+        printf("[uPNG] png setjump failed or activated\n");
+        return false;
+    }
+    /* what png_read_image does, without its array of row pointers */
+    for (int pass = 0; pass < m_passes; pass++)
+        for (int i = 0; i < m_height; i++)
+            png_read_row(m_png, (png_bytep)surface->data + i * surface->stride, NULL);
+    png_read_end(m_png, m_end);
+    m_row = m_height;
+    return true;
+}
+
+bool PNGDecoder::readRows(unsigned char *data, int stride, int count)
+{
+    if (m_interlaced || m_row + count > m_height)
+        return false;
+    if (setjmp(png_jmpbuf(m_png)))
+    {
+        printf("[uPNG] png setjump failed or activated\n");
+        return false;
+    }
+    for (int i = 0; i < count; i++)
+        png_read_row(m_png, data + i * stride, NULL);
+    m_row += count;
+    if (m_row == m_height)
+        png_read_end(m_png, m_end);
+    return true;
+}
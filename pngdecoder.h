@@ -0,0 +1,58 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PNGDECODER_H_
+#define _PNGDECODER_H_
+
+#include <stdio.h>
+#include "imagedecoder.h"
+
+/* libpng reader, see ImageDecoder */
+class PNGDecoder: public ImageDecoder
+{
+private:
+    FILE *m_fp;
+    const unsigned char *m_data; /* memory source */
+    size_t m_len, m_pos;
+    png_structp m_png;
+    png_infop m_info, m_end;
+    bool m_palette;
+    int m_row; /* next row to read */
+    int m_passes;
+
+    bool start();
+    static void readMemory(png_structp png, png_bytep out, png_size_t len);
+    static png_voidp arenaAlloc(png_structp png, png_alloc_size_t size);
+    static void arenaFree(png_structp png, png_voidp ptr);
+
+public:
+    PNGDecoder();
+    ~PNGDecoder();
+
+    /* read the header and set up the conversion, false if it is no png */
+    bool open(const char *filename);
+    /* the same for a png in memory, data has to stay valid while decoding */
+    bool open(const void *data, size_t len);
+    /* the same for a file or pipe, fp is closed with the decoder */
+    bool open(FILE *fp);
+
+    void getPalette(gUnmanagedSurface *surface);
+    bool readImage(gUnmanagedSurface *surface);
+    bool readRows(unsigned char *data, int stride, int count);
+};
+
+#endif
@@ -0,0 +1,378 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "resample.h"
+#include "framearena.h"
+
+#if !defined(NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define RESAMPLE_SSE2
+#include <emmintrin.h>
+#elif !defined(NO_SIMD) && defined(__ARM_NEON) && BYTE_ORDER == LITTLE_ENDIAN
+#define RESAMPLE_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ * Pixels are four int16 b g r a, colour premultiplied by alpha. The
+ * weights of a destination pixel add up to 1 << WBITS, the rows between
+ * the passes keep HBITS more bits, so every sum stays below 1 << 31 and
+ * every value between the passes below 1 << 15.
+ */
+#define WBITS 14
+#define HBITS 7
+
+/* the source pixels of every destination pixel on one axis */
+struct Axis
+{
+    int taps;        /* weights per destination pixel, even, unused ones are 0 */
+    int *first;      /* first source pixel */
+    int *count;      /* source pixels with a weight */
+    int16_t *weight;
+    int lo, hi;      /* source pixels used, [lo, hi) */
+};
+
+static inline int clamp(int v, int lo, int hi)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+/* destination pixels [from, from + n) of s source pixels scaled to d */
+static void buildAxis(Axis &ax, int s, int d, int from, int n, bool area, FrameArena &arena)
+{
+    int taps = area ? (s + d - 1) / d + 1 : 2;
+    taps = (taps + 1) & ~1;
+    ax.taps = taps;
+    ax.first = arena.alloc<int>(n);
+    ax.count = arena.alloc<int>(n);
+    ax.weight = arena.alloc<int16_t>(n * taps);
+    memset(ax.weight, 0, n * taps * sizeof(int16_t));
+    ax.lo = s;
+    ax.hi = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        int16_t *w = ax.weight + i * taps;
+        int64_t dst = from + i;
+        if (!area)
+        {
+            /* centre of the destination pixel in source pixels, 16.16 */
+            int64_t pos = ((2 * dst + 1) * s << 16) / (2 * d) - 0x8000;
+            int x0 = (int)(pos >> 16);
+            int f = (int)(pos & 0xFFFF) >> (16 - WBITS);
+            int a = clamp(x0, 0, s - 1), b = clamp(x0 + 1, 0, s - 1);
+            ax.first[i] = a;
+            if (a == b)
+            {
+                ax.count[i] = 1;
+                w[0] = 1 << WBITS;
+            }
+            else
+            {
+                ax.count[i] = 2;
+                w[0] = (1 << WBITS) - f;
+                w[1] = f;
+            }
+        }
+        else
+        {
+            /* in 1/d source pixels the destination pixel covers [left, right) */
+            int64_t left = dst * s, right = (dst + 1) * s;
+            int j0 = (int)(left / d), j1 = (int)((right - 1) / d);
+            int sum = 0, big = 0;
+            for (int j = j0; j <= j1; j++)
+            {
+                int64_t l = left > (int64_t)j * d ? left : (int64_t)j * d;
+                int64_t r = right < (int64_t)(j + 1) * d ? right : (int64_t)(j + 1) * d;
+                w[j - j0] = (int16_t)(((r - l) << WBITS) / s);
+                sum += w[j - j0];
+                if (w[j - j0] > w[big])
+                    big = j - j0;
+            }
+            /* what rounding lost goes to the largest weight */
+            w[big] += (1 << WBITS) - sum;
+            ax.first[i] = j0;
+            ax.count[i] = j1 - j0 + 1;
+        }
+        if (ax.first[i] < ax.lo)
+            ax.lo = ax.first[i];
+        if (ax.first[i] + ax.count[i] > ax.hi)
+            ax.hi = ax.first[i] + ax.count[i];
+    }
+}
+
+/* c * a / 255 rounded, exact for c, a <= 255 */
+static inline int mul255(int c, int a)
+{
+    int t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static void premultiply_c(int16_t *dst, const uint32_t *src, int n)
+{
+    for (int x = 0; x < n; x++, dst += 4)
+    {
+        uint32_t p = src[x];
+        int a = p >> 24;
+        dst[0] = mul255(p & 0xFF, a);
+        dst[1] = mul255((p >> 8) & 0xFF, a);
+        dst[2] = mul255((p >> 16) & 0xFF, a);
+        dst[3] = a;
+    }
+}
+
+/* values [from, n4) of rows[0 .. count) weighted by w, back to 8 bit premultiplied */
+static void filterColumn_c(uint8_t *out, int16_t *const *rows, const int16_t *w, int count, int from, int n4)
+{
+    for (int i = from; i < n4; i++)
+    {
+        int acc = 0;
+        for (int k = 0; k < count; k++)
+            acc += rows[k][i] * w[k];
+        out[i] = clamp((acc + (1 << (WBITS + HBITS - 1))) >> (WBITS + HBITS), 0, 255);
+    }
+}
+
+#if defined(RESAMPLE_SSE2)
+/* two pixels as b g r a b g r a in 16 bit lanes */
+static inline __m128i premultiply2(__m128i p)
+{
+    /* keeps b g r, the alpha lane is taken as it is */
+    const __m128i colour = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(p, 0xFF), 0xFF);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(p, a), _mm_set1_epi16(128));
+    t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    return _mm_or_si128(_mm_and_si128(colour, t), _mm_andnot_si128(colour, p));
+}
+
+static void premultiply(int16_t *dst, const uint32_t *src, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (; n >= 4; n -= 4, src += 4, dst += 16)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, premultiply2(_mm_unpacklo_epi8(p, zero)));
+        _mm_storeu_si128((__m128i *)(dst + 8), premultiply2(_mm_unpackhi_epi8(p, zero)));
+    }
+    premultiply_c(dst, src, n);
+}
+
+/* the weights of taps k and k + 1 in every 32 bit lane */
+static inline __m128i weightPair(const int16_t *w)
+{
+    int32_t pair;
+    memcpy(&pair, w, sizeof(pair));
+    return _mm_set1_epi32(pair);
+}
+
+static void filterRow(int16_t *out, const int16_t *in, const Axis &ax, int n)
+{
+    const __m128i round = _mm_set1_epi32(1 << (WBITS - HBITS - 1));
+    for (int x = 0; x < n; x++, out += 4)
+    {
+        const int16_t *p = in + (ax.first[x] - ax.lo) * 4;
+        const int16_t *w = ax.weight + x * ax.taps;
+        __m128i acc = round;
+        /* two source pixels per madd, b0 b1 g0 g1 .. times w0 w1 */
+        for (int k = 0; k < ax.count[x]; k += 2, p += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            v = _mm_unpacklo_epi16(v, _mm_srli_si128(v, 8));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(v, weightPair(w + k)));
+        }
+        acc = _mm_srai_epi32(acc, WBITS - HBITS);
+        _mm_storel_epi64((__m128i *)out, _mm_packs_epi32(acc, acc));
+    }
+}
+
+static void filterColumn(uint8_t *out, int16_t *const *rows, const int16_t *w, int count, int n4)
+{
+    const __m128i round = _mm_set1_epi32(1 << (WBITS + HBITS - 1));
+    int i = 0;
+    for (; i + 8 <= n4; i += 8)
+    {
+        __m128i lo = round, hi = round;
+        for (int k = 0; k < count; k += 2)
+        {
+            /* an odd last row goes with itself and weight 0 */
+            const int16_t *r1 = rows[k + 1 < count ? k + 1 : k];
+            __m128i a = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(r1 + i));
+            __m128i wp = weightPair(w + k);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wp));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wp));
+        }
+        __m128i v = _mm_packs_epi32(_mm_srai_epi32(lo, WBITS + HBITS), _mm_srai_epi32(hi, WBITS + HBITS));
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(v, v));
+    }
+    filterColumn_c(out, rows, w, count, i, n4);
+}
+#elif defined(RESAMPLE_NEON)
+static void premultiply(int16_t *dst, const uint32_t *src, int n)
+{
+    const uint16x8_t c128 = vdupq_n_u16(128);
+    for (; n >= 8; n -= 8, src += 8, dst += 32)
+    {
+        uint8x8x4_t p = vld4_u8((const uint8_t *)src);
+        uint16x8x4_t q;
+        for (int c = 0; c < 3; c++)
+        {
+            uint16x8_t t = vmlal_u8(c128, p.val[c], p.val[3]);
+            q.val[c] = vshrq_n_u16(vsraq_n_u16(t, t, 8), 8);
+        }
+        q.val[3] = vmovl_u8(p.val[3]);
+        vst4q_u16((uint16_t *)dst, q);
+    }
+    premultiply_c(dst, src, n);
+}
+
+static void filterRow(int16_t *out, const int16_t *in, const Axis &ax, int n)
+{
+    for (int x = 0; x < n; x++, out += 4)
+    {
+        const int16_t *p = in + (ax.first[x] - ax.lo) * 4;
+        const int16_t *w = ax.weight + x * ax.taps;
+        int32x4_t acc = vdupq_n_s32(0);
+        for (int k = 0; k < ax.count[x]; k++, p += 4)
+            acc = vmlal_n_s16(acc, vld1_s16(p), w[k]);
+        vst1_s16(out, vqmovn_s32(vrshrq_n_s32(acc, WBITS - HBITS)));
+    }
+}
+
+static void filterColumn(uint8_t *out, int16_t *const *rows, const int16_t *w, int count, int n4)
+{
+    int i = 0;
+    for (; i + 8 <= n4; i += 8)
+    {
+        int32x4_t lo = vdupq_n_s32(0), hi = vdupq_n_s32(0);
+        for (int k = 0; k < count; k++)
+        {
+            int16x8_t a = vld1q_s16(rows[k] + i);
+            lo = vmlal_n_s16(lo, vget_low_s16(a), w[k]);
+            hi = vmlal_n_s16(hi, vget_high_s16(a), w[k]);
+        }
+        int16x8_t v = vcombine_s16(vqmovn_s32(vrshrq_n_s32(lo, WBITS + HBITS)), vqmovn_s32(vrshrq_n_s32(hi, WBITS + HBITS)));
+        vst1_u8(out + i, vqmovun_s16(v));
+    }
+    filterColumn_c(out, rows, w, count, i, n4);
+}
+#else
+#define premultiply premultiply_c
+
+static void filterRow(int16_t *out, const int16_t *in, const Axis &ax, int n)
+{
+    for (int x = 0; x < n; x++, out += 4)
+    {
+        const int16_t *p = in + (ax.first[x] - ax.lo) * 4;
+        const int16_t *w = ax.weight + x * ax.taps;
+        int acc[4] = { 0, 0, 0, 0 };
+        for (int k = 0; k < ax.count[x]; k++, p += 4)
+            for (int c = 0; c < 4; c++)
+                acc[c] += p[c] * w[k];
+        for (int c = 0; c < 4; c++)
+            out[c] = (acc[c] + (1 << (WBITS - HBITS - 1))) >> (WBITS - HBITS);
+    }
+}
+
+static void filterColumn(uint8_t *out, int16_t *const *rows, const int16_t *w, int count, int n4)
+{
+    filterColumn_c(out, rows, w, count, 0, n4);
+}
+#endif
+
+/* 255 / a in 16.16 for taking the alpha back out */
+static const struct Unpremultiply
+{
+    uint32_t recip[256];
+    Unpremultiply()
+    {
+        recip[0] = 0;
+        for (int a = 1; a != 256; ++a)
+            recip[a] = ((255 << 16) + a / 2) / a;
+    }
+} unpremultiply;
+
+void resample(const gUnmanagedSurface *src, const uint32_t *pal, int sw, int sh, int dw, int dh, const eRect &part,
+    gUnmanagedSurface *out, int mode, FrameArena &arena)
+{
+    FrameArena::Scope scope(arena);
+    const bool area = mode & uPNG::blitScaleArea;
+    const int n = part.width();
+    Axis ax, ay;
+    buildAxis(ax, sw, dw, part.left(), n, area, arena);
+    buildAxis(ay, sh, dh, part.top(), part.height(), area, arena);
+
+    /* palette images are premultiplied once per colour */
+    int16_t *ppal = NULL;
+    if (src->bpp == 8)
+    {
+        ppal = arena.alloc<int16_t>(256 * 4);
+        premultiply(ppal, pal, 256);
+    }
+
+    /* one source row premultiplied, with a spare pixel for the pairs of taps */
+    const int span = ax.hi - ax.lo;
+    int16_t *line = arena.alloc<int16_t>((span + 1) * 4);
+    memset(line + span * 4, 0, 4 * sizeof(int16_t));
+
+    /* horizontally filtered rows, the rows of one destination row never share a slot */
+    const int slots = ay.taps;
+    int16_t **ring = arena.alloc<int16_t *>(slots);
+    int *tag = arena.alloc<int>(slots);
+    for (int k = 0; k < slots; k++)
+    {
+        ring[k] = arena.alloc<int16_t>(n * 4 + 8);
+        tag[k] = -1;
+    }
+    int16_t **rows = arena.alloc<int16_t *>(slots);
+    uint8_t *premul = arena.alloc<uint8_t>(n * 4);
+
+    for (int y = 0; y < part.height(); y++)
+    {
+        const int count = ay.count[y];
+        for (int k = 0; k < count; k++)
+        {
+            int sy = ay.first[y] + k, slot = sy % slots;
+            if (tag[slot] != sy)
+            {
+                const uint8_t *s = (const uint8_t *)src->data + sy * src->stride;
+                if (ppal)
+                {
+                    for (int x = 0; x < span; x++)
+                        memcpy(line + x * 4, ppal + s[ax.lo + x] * 4, 4 * sizeof(int16_t));
+                }
+                else
+                    premultiply(line, (const uint32_t *)s + ax.lo, span);
+                filterRow(ring[slot], line, ax, n);
+                tag[slot] = sy;
+            }
+            rows[k] = ring[slot];
+        }
+        filterColumn(premul, rows, ay.weight + y * ay.taps, count, n * 4);
+
+        uint8_t *d = (uint8_t *)out->data + y * out->stride;
+        for (int x = 0; x < n; x++, d += 4)
+        {
+            const uint8_t *p = premul + x * 4;
+            uint32_t r = unpremultiply.recip[p[3]];
+            d[0] = clamp((p[0] * r + 0x8000) >> 16, 0, 255);
+            d[1] = clamp((p[1] * r + 0x8000) >> 16, 0, 255);
+            d[2] = clamp((p[2] * r + 0x8000) >> 16, 0, 255);
+            d[3] = p[3];
+        }
+    }
+}
@@ -0,0 +1,40 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include <stdint.h>
+#include "upng.h"
+
+class FrameArena;
+
+/*
+ * Filtered scaling for uPNG::blit. The top left sw x sh pixels of src are
+ * scaled to dw x dh, out receives the part of the result that is visible,
+ * out has the size of part and 32bpp. Colour is filtered with alpha
+ * weighting, in a horizontal and a vertical pass, SSE2 or NEON do a
+ * pixel or two at a time.
+ *
+ * mode uPNG::blitScaleBilinear samples the two nearest pixels on each
+ * axis, good down to about half the size. uPNG::blitScaleArea averages
+ * everything a destination pixel covers, for any shrink.
+ */
+void resample(const gUnmanagedSurface *src, const uint32_t *pal, int sw, int sh, int dw, int dh, const eRect &part,
+    gUnmanagedSurface *out, int mode, FrameArena &arena);
+
+#endif
@@ -0,0 +1,442 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <byteswap.h>
+#include "rgb565.h"
+
+#if !defined(NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define RGB565_X86
+#include <immintrin.h>
+#elif !defined(NO_SIMD) && defined(__ARM_NEON) && BYTE_ORDER == LITTLE_ENDIAN
+#define RGB565_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*ConvertRow)(uint16_t *dst, const uint32_t *src, int width);
+typedef void (*SwapRow)(uint16_t *dst, const uint16_t *src, int width);
+
+struct Kernels
+{
+    ConvertRow blit, blit_at, blend;
+    SwapRow bitorder;
+};
+
+static inline uint16_t to565(uint32_t icol)
+{
+    uint16_t pix = ((icol & 0xFF) >> 3) << 11 | ((icol & 0xFF00) >> 10) << 5 | (icol & 0xFF0000) >> 19;
+#if BYTE_ORDER == LITTLE_ENDIAN
+    return bswap_16(pix);
+#else
+    return pix;
+#endif
+}
+
+/*
+ * x / 255 rounded towards 0 for |x| <= 255 * 255, checked against the
+ * division for every value. The sum never exceeds 0xff00, the vector
+ * versions do it in 16 bit lanes.
+ */
+static inline int div255(int x)
+{
+    int m = x >> 31;
+    int ax = (x ^ m) - m;
+    int q = (ax + 1 + (ax >> 8)) >> 8;
+    return (q ^ m) - m;
+}
+
+static void blit_row_c(uint16_t *dst, const uint32_t *src, int width)
+{
+    while (width--)
+        *dst++ = to565(*src++);
+}
+
+static void blit_at_row_c(uint16_t *dst, const uint32_t *src, int width)
+{
+    for (; width--; src++, dst++)
+        if (*src & 0xFF000000)
+            *dst = to565(*src);
+}
+
+static void blend_row_c(uint16_t *dst, const uint32_t *src, int width)
+{
+    for (; width--; src++, dst++)
+    {
+        uint32_t icol = *src;
+        int a = icol >> 24;
+        if (!a)
+            continue;
+#if BYTE_ORDER == LITTLE_ENDIAN
+        uint32_t jcol = bswap_16(*dst);
+#else
+        uint32_t jcol = *dst;
+#endif
+        int bg_b = (jcol >> 8) & 0xF8;
+        int bg_g = (jcol >> 3) & 0xFC;
+        int bg_r = (jcol << 3) & 0xF8;
+        int b = bg_b + div255(((int)(icol & 0xFF) - bg_b) * a);
+        int g = bg_g + div255(((int)((icol >> 8) & 0xFF) - bg_g) * a);
+        int r = bg_r + div255(((int)((icol >> 16) & 0xFF) - bg_r) * a);
+        *dst = to565(r << 16 | g << 8 | b);
+    }
+}
+
+static void bitorder_row_c(uint16_t *dst, const uint16_t *src, int width)
+{
+    while (width--)
+    {
+        uint16_t pix = *src++;
+        *dst++ = (pix & 0xE007) | (pix & 0x1F00) >> 5 | (pix & 0x00F8) << 5;
+    }
+}
+
+#if defined(RGB565_X86)
+/* SSE2 only packs signed, values up to 0xffff have to be sign extended first */
+static inline __m128i pack16(__m128i lo, __m128i hi)
+{
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    return _mm_packs_epi32(lo, hi);
+}
+
+static inline __m128i swap16(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+/* 565 of four pixels in 32 bit lanes */
+static inline __m128i pix565(__m128i p)
+{
+    __m128i b = _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xF8)), 8);
+    __m128i g = _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xFC00)), 5);
+    __m128i r = _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xF80000)), 19);
+    return _mm_or_si128(_mm_or_si128(b, g), r);
+}
+
+/* bg + (c - bg) * a / 255 in 16 bit lanes, see div255() */
+static inline __m128i mix(__m128i c, __m128i bg, __m128i a)
+{
+    __m128i d = _mm_sub_epi16(c, bg);
+    __m128i m = _mm_srai_epi16(d, 15);
+    __m128i p = _mm_mullo_epi16(_mm_sub_epi16(_mm_xor_si128(d, m), m), a);
+    __m128i q = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(p, _mm_set1_epi16(1)), _mm_srli_epi16(p, 8)), 8);
+    return _mm_add_epi16(bg, _mm_sub_epi16(_mm_xor_si128(q, m), m));
+}
+
+static void blit_row_sse2(uint16_t *dst, const uint32_t *src, int width)
+{
+    for (; width >= 8; width -= 8, src += 8, dst += 8)
+    {
+        __m128i s0 = _mm_loadu_si128((const __m128i *)src);
+        __m128i s1 = _mm_loadu_si128((const __m128i *)(src + 4));
+        _mm_storeu_si128((__m128i *)dst, swap16(pack16(pix565(s0), pix565(s1))));
+    }
+    blit_row_c(dst, src, width);
+}
+
+static void blit_at_row_sse2(uint16_t *dst, const uint32_t *src, int width)
+{
+    const __m128i amask = _mm_set1_epi32(0xFF000000);
+    const __m128i zero = _mm_setzero_si128();
+    for (; width >= 8; width -= 8, src += 8, dst += 8)
+    {
+        __m128i s0 = _mm_loadu_si128((const __m128i *)src);
+        __m128i s1 = _mm_loadu_si128((const __m128i *)(src + 4));
+        /* all ones where the pixel is transparent */
+        __m128i t = _mm_packs_epi32(_mm_cmpeq_epi32(_mm_and_si128(s0, amask), zero), _mm_cmpeq_epi32(_mm_and_si128(s1, amask), zero));
+        __m128i d = _mm_loadu_si128((const __m128i *)dst);
+        __m128i v = swap16(pack16(pix565(s0), pix565(s1)));
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(t, d), _mm_andnot_si128(t, v)));
+    }
+    blit_at_row_c(dst, src, width);
+}
+
+static void blend_row_sse2(uint16_t *dst, const uint32_t *src, int width)
+{
+    const __m128i low = _mm_set1_epi32(0xFF);
+    for (; width >= 8; width -= 8, src += 8, dst += 8)
+    {
+        __m128i s0 = _mm_loadu_si128((const __m128i *)src);
+        __m128i s1 = _mm_loadu_si128((const __m128i *)(src + 4));
+        __m128i a = _mm_packs_epi32(_mm_srli_epi32(s0, 24), _mm_srli_epi32(s1, 24));
+        /* alpha 0 leaves the pixel as it is, the same goes for eight of them */
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(a, _mm_setzero_si128())) == 0xFFFF)
+            continue;
+        __m128i b = _mm_packs_epi32(_mm_and_si128(s0, low), _mm_and_si128(s1, low));
+        __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(s0, 8), low), _mm_and_si128(_mm_srli_epi32(s1, 8), low));
+        __m128i r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(s0, 16), low), _mm_and_si128(_mm_srli_epi32(s1, 16), low));
+        __m128i j = swap16(_mm_loadu_si128((const __m128i *)dst));
+        b = mix(b, _mm_and_si128(_mm_srli_epi16(j, 8), _mm_set1_epi16(0xF8)), a);
+        g = mix(g, _mm_and_si128(_mm_srli_epi16(j, 3), _mm_set1_epi16(0xFC)), a);
+        r = mix(r, _mm_and_si128(_mm_slli_epi16(j, 3), _mm_set1_epi16(0xF8)), a);
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, _mm_set1_epi16(0xF8)), 8),
+            _mm_slli_epi16(_mm_and_si128(g, _mm_set1_epi16(0xFC)), 3)), _mm_srli_epi16(r, 3));
+        _mm_storeu_si128((__m128i *)dst, swap16(v));
+    }
+    blend_row_c(dst, src, width);
+}
+
+static void bitorder_row_sse2(uint16_t *dst, const uint16_t *src, int width)
+{
+    for (; width >= 8; width -= 8, src += 8, dst += 8)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i *)src);
+        __m128i v = _mm_or_si128(_mm_and_si128(p, _mm_set1_epi16((short)0xE007)),
+            _mm_or_si128(_mm_srli_epi16(_mm_and_si128(p, _mm_set1_epi16(0x1F00)), 5),
+                _mm_slli_epi16(_mm_and_si128(p, _mm_set1_epi16(0x00F8)), 5)));
+        _mm_storeu_si128((__m128i *)dst, v);
+    }
+    bitorder_row_c(dst, src, width);
+}
+
+/*
+ * The AVX2 versions do sixteen pixels. Packing works per 128 bit half,
+ * the permute puts the four groups of four pixels back in order.
+ */
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i pack16_avx2(__m256i lo, __m256i hi)
+{
+    lo = _mm256_srai_epi32(_mm256_slli_epi32(lo, 16), 16);
+    hi = _mm256_srai_epi32(_mm256_slli_epi32(hi, 16), 16);
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+}
+
+AVX2 static inline __m256i swap16_avx2(__m256i v)
+{
+    return _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+}
+
+AVX2 static inline __m256i pix565_avx2(__m256i p)
+{
+    __m256i b = _mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0xF8)), 8);
+    __m256i g = _mm256_srli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0xFC00)), 5);
+    __m256i r = _mm256_srli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0xF80000)), 19);
+    return _mm256_or_si256(_mm256_or_si256(b, g), r);
+}
+
+AVX2 static inline __m256i mix_avx2(__m256i c, __m256i bg, __m256i a)
+{
+    __m256i d = _mm256_sub_epi16(c, bg);
+    __m256i m = _mm256_srai_epi16(d, 15);
+    __m256i p = _mm256_mullo_epi16(_mm256_sub_epi16(_mm256_xor_si256(d, m), m), a);
+    __m256i q = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(p, _mm256_set1_epi16(1)), _mm256_srli_epi16(p, 8)), 8);
+    return _mm256_add_epi16(bg, _mm256_sub_epi16(_mm256_xor_si256(q, m), m));
+}
+
+AVX2 static void blit_row_avx2(uint16_t *dst, const uint32_t *src, int width)
+{
+    for (; width >= 16; width -= 16, src += 16, dst += 16)
+    {
+        __m256i s0 = _mm256_loadu_si256((const __m256i *)src);
+        __m256i s1 = _mm256_loadu_si256((const __m256i *)(src + 8));
+        _mm256_storeu_si256((__m256i *)dst, swap16_avx2(pack16_avx2(pix565_avx2(s0), pix565_avx2(s1))));
+    }
+    blit_row_sse2(dst, src, width);
+}
+
+AVX2 static void blit_at_row_avx2(uint16_t *dst, const uint32_t *src, int width)
+{
+    const __m256i amask = _mm256_set1_epi32(0xFF000000);
+    const __m256i zero = _mm256_setzero_si256();
+    for (; width >= 16; width -= 16, src += 16, dst += 16)
+    {
+        __m256i s0 = _mm256_loadu_si256((const __m256i *)src);
+        __m256i s1 = _mm256_loadu_si256((const __m256i *)(src + 8));
+        __m256i t = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_cmpeq_epi32(_mm256_and_si256(s0, amask), zero),
+            _mm256_cmpeq_epi32(_mm256_and_si256(s1, amask), zero)), 0xD8);
+        __m256i d = _mm256_loadu_si256((const __m256i *)dst);
+        __m256i v = swap16_avx2(pack16_avx2(pix565_avx2(s0), pix565_avx2(s1)));
+        _mm256_storeu_si256((__m256i *)dst, _mm256_blendv_epi8(v, d, t));
+    }
+    blit_at_row_sse2(dst, src, width);
+}
+
+AVX2 static void blend_row_avx2(uint16_t *dst, const uint32_t *src, int width)
+{
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    for (; width >= 16; width -= 16, src += 16, dst += 16)
+    {
+        __m256i s0 = _mm256_loadu_si256((const __m256i *)src);
+        __m256i s1 = _mm256_loadu_si256((const __m256i *)(src + 8));
+        __m256i a = pack16_avx2(_mm256_srli_epi32(s0, 24), _mm256_srli_epi32(s1, 24));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(a, _mm256_setzero_si256())) == -1)
+            continue;
+        __m256i b = pack16_avx2(_mm256_and_si256(s0, low), _mm256_and_si256(s1, low));
+        __m256i g = pack16_avx2(_mm256_and_si256(_mm256_srli_epi32(s0, 8), low), _mm256_and_si256(_mm256_srli_epi32(s1, 8), low));
+        __m256i r = pack16_avx2(_mm256_and_si256(_mm256_srli_epi32(s0, 16), low), _mm256_and_si256(_mm256_srli_epi32(s1, 16), low));
+        __m256i j = swap16_avx2(_mm256_loadu_si256((const __m256i *)dst));
+        b = mix_avx2(b, _mm256_and_si256(_mm256_srli_epi16(j, 8), _mm256_set1_epi16(0xF8)), a);
+        g = mix_avx2(g, _mm256_and_si256(_mm256_srli_epi16(j, 3), _mm256_set1_epi16(0xFC)), a);
+        r = mix_avx2(r, _mm256_and_si256(_mm256_slli_epi16(j, 3), _mm256_set1_epi16(0xF8)), a);
+        __m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(b, _mm256_set1_epi16(0xF8)), 8),
+            _mm256_slli_epi16(_mm256_and_si256(g, _mm256_set1_epi16(0xFC)), 3)), _mm256_srli_epi16(r, 3));
+        _mm256_storeu_si256((__m256i *)dst, swap16_avx2(v));
+    }
+    blend_row_sse2(dst, src, width);
+}
+
+AVX2 static void bitorder_row_avx2(uint16_t *dst, const uint16_t *src, int width)
+{
+    for (; width >= 16; width -= 16, src += 16, dst += 16)
+    {
+        __m256i p = _mm256_loadu_si256((const __m256i *)src);
+        __m256i v = _mm256_or_si256(_mm256_and_si256(p, _mm256_set1_epi16((short)0xE007)),
+            _mm256_or_si256(_mm256_srli_epi16(_mm256_and_si256(p, _mm256_set1_epi16(0x1F00)), 5),
+                _mm256_slli_epi16(_mm256_and_si256(p, _mm256_set1_epi16(0x00F8)), 5)));
+        _mm256_storeu_si256((__m256i *)dst, v);
+    }
+    bitorder_row_sse2(dst, src, width);
+}
+#undef AVX2
+#elif defined(RGB565_NEON)
+/*
+ * vld4 splits sixteen pixels into b g r a registers, the two bytes of a
+ * big endian 565 pixel are b5 g3 and g3 r5, vst2 interleaves them.
+ */
+static inline uint8x16x2_t pix565(uint8x16x4_t s)
+{
+    uint8x16x2_t v;
+    v.val[0] = vorrq_u8(vandq_u8(s.val[0], vdupq_n_u8(0xF8)), vshrq_n_u8(s.val[1], 5));
+    v.val[1] = vorrq_u8(vandq_u8(vshlq_n_u8(s.val[1], 3), vdupq_n_u8(0xE0)), vshrq_n_u8(s.val[2], 3));
+    return v;
+}
+
+/* bg + (c - bg) * a / 255 in 16 bit lanes, see div255() */
+static inline uint16x8_t mix(uint16x8_t c, uint16x8_t bg, uint16x8_t a)
+{
+    int16x8_t d = vsubq_s16(vreinterpretq_s16_u16(c), vreinterpretq_s16_u16(bg));
+    int16x8_t m = vshrq_n_s16(d, 15);
+    uint16x8_t p = vmulq_u16(vreinterpretq_u16_s16(vabsq_s16(d)), a);
+    uint16x8_t q = vshrq_n_u16(vaddq_u16(vaddq_u16(p, vdupq_n_u16(1)), vshrq_n_u16(p, 8)), 8);
+    int16x8_t sq = vsubq_s16(veorq_s16(vreinterpretq_s16_u16(q), m), m);
+    return vreinterpretq_u16_s16(vaddq_s16(vreinterpretq_s16_u16(bg), sq));
+}
+
+static void blit_row_neon(uint16_t *dst, const uint32_t *src, int width)
+{
+    for (; width >= 16; width -= 16, src += 16, dst += 16)
+        vst2q_u8((uint8_t *)dst, pix565(vld4q_u8((const uint8_t *)src)));
+    blit_row_c(dst, src, width);
+}
+
+static void blit_at_row_neon(uint16_t *dst, const uint32_t *src, int width)
+{
+    for (; width >= 16; width -= 16, src += 16, dst += 16)
+    {
+        uint8x16x4_t s = vld4q_u8((const uint8_t *)src);
+        uint8x16_t t = vceqq_u8(s.val[3], vdupq_n_u8(0));
+        uint8x16x2_t d = vld2q_u8((const uint8_t *)dst);
+        uint8x16x2_t v = pix565(s);
+        v.val[0] = vbslq_u8(t, d.val[0], v.val[0]);
+        v.val[1] = vbslq_u8(t, d.val[1], v.val[1]);
+        vst2q_u8((uint8_t *)dst, v);
+    }
+    blit_at_row_c(dst, src, width);
+}
+
+static void blend_row_neon(uint16_t *dst, const uint32_t *src, int width)
+{
+    for (; width >= 8; width -= 8, src += 8, dst += 8)
+    {
+        uint8x8x4_t s = vld4_u8((const uint8_t *)src);
+        if (!vget_lane_u64(vreinterpret_u64_u8(s.val[3]), 0))
+            continue;
+        uint16x8_t a = vmovl_u8(s.val[3]);
+        uint16x8_t j = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8((const uint8_t *)dst)));
+        uint16x8_t b = mix(vmovl_u8(s.val[0]), vandq_u16(vshrq_n_u16(j, 8), vdupq_n_u16(0xF8)), a);
+        uint16x8_t g = mix(vmovl_u8(s.val[1]), vandq_u16(vshrq_n_u16(j, 3), vdupq_n_u16(0xFC)), a);
+        uint16x8_t r = mix(vmovl_u8(s.val[2]), vandq_u16(vshlq_n_u16(j, 3), vdupq_n_u16(0xF8)), a);
+        uint16x8_t v = vorrq_u16(vorrq_u16(vshlq_n_u16(vandq_u16(b, vdupq_n_u16(0xF8)), 8),
+            vshlq_n_u16(vandq_u16(g, vdupq_n_u16(0xFC)), 3)), vshrq_n_u16(r, 3));
+        vst1q_u8((uint8_t *)dst, vrev16q_u8(vreinterpretq_u8_u16(v)));
+    }
+    blend_row_c(dst, src, width);
+}
+
+static void bitorder_row_neon(uint16_t *dst, const uint16_t *src, int width)
+{
+    for (; width >= 8; width -= 8, src += 8, dst += 8)
+    {
+        uint16x8_t p = vld1q_u16(src);
+        uint16x8_t v = vorrq_u16(vandq_u16(p, vdupq_n_u16(0xE007)),
+            vorrq_u16(vshrq_n_u16(vandq_u16(p, vdupq_n_u16(0x1F00)), 5), vshlq_n_u16(vandq_u16(p, vdupq_n_u16(0x00F8)), 5)));
+        vst1q_u16(dst, v);
+    }
+    bitorder_row_c(dst, src, width);
+}
+#endif
+
+static Kernels selectKernels()
+{
+#if defined(RGB565_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        Kernels k = { blit_row_avx2, blit_at_row_avx2, blend_row_avx2, bitorder_row_avx2 };
+        return k;
+    }
+    Kernels k = { blit_row_sse2, blit_at_row_sse2, blend_row_sse2, bitorder_row_sse2 };
+#elif defined(RGB565_NEON)
+    Kernels k = { blit_row_neon, blit_at_row_neon, blend_row_neon, bitorder_row_neon };
+#else
+    Kernels k = { blit_row_c, blit_at_row_c, blend_row_c, bitorder_row_c };
+#endif
+    return k;
+}
+
+static const Kernels &kernels()
+{
+    static const Kernels k = selectKernels();
+    return k;
+}
+
+void blit_32_to_16(uint16_t *dst, const uint32_t *src, int width)
+{
+    kernels().blit(dst, src, width);
+}
+
+void blit_32_to_16_at(uint16_t *dst, const uint32_t *src, int width)
+{
+    kernels().blit_at(dst, src, width);
+}
+
+void blend_32_to_16(uint16_t *dst, const uint32_t *src, int width)
+{
+    kernels().blend(dst, src, width);
+}
+
+void blend_8i_to_16(uint16_t *dst, const uint8_t *src, const uint32_t *pal, int width)
+{
+    /* expand a piece of the row, then blend it like a 32 bit one */
+    ConvertRow blend = kernels().blend;
+    uint32_t argb[64];
+    while (width > 0)
+    {
+        int n = width < 64 ? width : 64;
+        for (int x = 0; x < n; x++)
+            argb[x] = pal[src[x]];
+        blend(dst, argb, n);
+        dst += n;
+        src += n;
+        width -= n;
+    }
+}
+
+void swap_565_bitorder(uint16_t *dst, const uint16_t *src, int width)
+{
+    kernels().bitorder(dst, src, width);
+}
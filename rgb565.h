@@ -0,0 +1,39 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RGB565_H_
+#define _RGB565_H_
+
+#include <stdint.h>
+
+/*
+ * Pixel rows from 32bpp to the 16bpp panel layout, blue in the top bits
+ * and big endian in memory. Like blend.h, SSE2, AVX2 or NEON do several
+ * pixels at once with the same results as the plain loop, -DNO_SIMD keeps
+ * only the plain loop.
+ */
+void blit_32_to_16(uint16_t *dst, const uint32_t *src, int width);
+/* pixels with alpha 0 are left out */
+void blit_32_to_16_at(uint16_t *dst, const uint32_t *src, int width);
+/* per channel dst + (src - dst) * a / 255, the division rounds towards 0 */
+void blend_32_to_16(uint16_t *dst, const uint32_t *src, int width);
+/* the same for palette indices, pal is gLookup::argb */
+void blend_8i_to_16(uint16_t *dst, const uint8_t *src, const uint32_t *pal, int width);
+/* gggrrrrrbbbbbggg in memory to gggbbbbbrrrrrggg for LCD_COLOR_BITORDER_RGB565 panels */
+void swap_565_bitorder(uint16_t *dst, const uint16_t *src, int width);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstring>
+
+#include "slideshow.h"
+#include "pacing.h"
+
+static bool isPNG(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 4 && !strcasecmp(name + len - 4, ".png");
+}
+
+VFDSlideshow::VFDSlideshow(VFD *vfd, int interval)
+{
+    m_vfd = vfd;
+    m_interval = interval > 0 ? interval : 1;
+    m_loops = 0;
+    m_x = m_y = 0;
+    m_back = NULL;
+    m_loaded = -1;
+}
+
+VFDSlideshow::~VFDSlideshow()
+{
+    if (m_loader.joinable())
+        m_loader.join();
+    delete m_back;
+}
+
+int VFDSlideshow::add(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) < 0)
+    {
+        printf("[VFD] %s not found\n", path);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        m_files.push_back(path);
+        return 0;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir)
+    {
+        printf("[VFD] couldn't open %s (%m)\n", path);
+        return -1;
+    }
+    std::vector<std::string> found;
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL)
+    {
+        if (e->d_name[0] != '.' && isPNG(e->d_name))
+            found.push_back(std::string(path) + "/" + e->d_name);
+    }
+    closedir(dir);
+    std::sort(found.begin(), found.end());
+    m_files.insert(m_files.end(), found.begin(), found.end());
+    return 0;
+}
+
+/* runs on the loader thread, the back buffer is not touched by anyone else meanwhile */
+void VFDSlideshow::load(size_t index)
+{
+    memset(m_back->data, 0, m_back->y * m_back->stride);
+    m_loaded = m_png.render(m_files[index].c_str(), m_x, m_y, m_back, m_back->x - m_x, m_back->y - m_y, m_back->bpp, m_vfd->blitFlags());
+}
+
+int VFDSlideshow::run()
+{
+    if (m_files.empty())
+        return -1;
+
+    catchStop();
+
+    m_back = m_vfd->createSurface();
+    m_loader = std::thread(&VFDSlideshow::load, this, 0);
+
+    size_t total = m_loops > 0 ? m_files.size() * m_loops : 0;
+    int shown = 0;
+    struct timespec due;
+    clock_gettime(CLOCK_MONOTONIC, &due);
+
+    for (size_t i = 0; !stopRequested() && (total == 0 || i < total); i++)
+    {
+        size_t index = i % m_files.size();
+        m_loader.join();
+        bool drawn = m_loaded == 0;
+        if (drawn)
+        {
+            /* the copy is done here, the back buffer is free again afterwards */
+            m_vfd->displaySurface(m_back);
+            shown++;
+        }
+        else
+            printf("[VFD] couldn't draw %s\n", m_files[index].c_str());
+
+        if (total == 0 || i + 1 < total)
+            m_loader = std::thread(&VFDSlideshow::load, this, (index + 1) % m_files.size());
+        else
+            break;
+
+        if (shown == 0 && i + 1 >= m_files.size())
+            break; /* nothing in the list can be drawn */
+        if (!drawn)
+            continue;
+
+        waitUntil(due, m_interval);
+    }
+    if (m_loader.joinable())
+        m_loader.join();
+    m_vfd->flush();
+    return shown ? 0 : -1;
+}
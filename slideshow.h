@@ -0,0 +1,61 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SLIDESHOW_H_
+#define _SLIDESHOW_H_
+
+#include <string>
+#include <vector>
+#include <thread>
+#include "vfd.h"
+
+/*
+ * Shows a list of images in turn. While one image is on the panel the next
+ * one is decoded and drawn into a back buffer by a helper thread, so the
+ * switch itself only copies the back buffer and writes the panel.
+ */
+class VFDSlideshow
+{
+private:
+    VFD *m_vfd;
+    std::vector<std::string> m_files;
+    int m_interval; /* ms */
+    int m_loops;
+    int m_x, m_y;
+
+    uPNG m_png;
+    gSurface *m_back;
+    std::thread m_loader;
+    int m_loaded; /* render result for the back buffer */
+
+    void load(size_t index);
+
+public:
+    VFDSlideshow(VFD *vfd, int interval);
+    ~VFDSlideshow();
+
+    /* a png file, or a directory whose png files are shown in name order */
+    int add(const char *path);
+    void setPosition(int x, int y) { m_x = x; m_y = y; }
+    /* number of passes over the list, 0 loops until SIGTERM/SIGINT */
+    void setLoops(int loops) { m_loops = loops; }
+    void setImageCache(ImageCache *cache) { m_png.setCache(cache); }
+    size_t count() const { return m_files.size(); }
+    int run();
+};
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "surfacepool.h"
+
+#define SURFACEPOOL_IDLE (2 * 1024 * 1024)
+
+SurfacePool::SurfacePool(size_t limit)
+{
+    m_limit = limit;
+    m_reused = m_allocated = 0;
+}
+
+SurfacePool &SurfacePool::shared()
+{
+    static SurfacePool pool(SURFACEPOOL_IDLE);
+    return pool;
+}
+
+/* 4k, then four classes per power of two, at most a quarter is wasted */
+size_t SurfacePool::sizeClass(size_t bytes)
+{
+    if (bytes <= 4096)
+        return 4096;
+    size_t step = 4096;
+    while (step * 8 < bytes)
+        step <<= 1;
+    return (bytes + step - 1) & ~(step - 1);
+}
+
+std::shared_ptr<gSurface> SurfacePool::get(int width, int height, int bpp)
+{
+    gUnmanagedSurface shape(width, height, bpp);
+    size_t capacity = sizeClass((size_t)shape.y * shape.stride);
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    for (std::list<Entry>::iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+    {
+        /* only the pool knows it, nobody can pick it up meanwhile */
+        if (it->capacity != capacity || it->surface.use_count() != 1)
+            continue;
+        gSurface *s = it->surface.get();
+        s->x = shape.x;
+        s->y = shape.y;
+        s->bpp = shape.bpp;
+        s->bypp = shape.bypp;
+        s->stride = shape.stride;
+        delete [] s->clut.data;
+        s->clut.data = 0;
+        s->clut.colors = s->clut.start = 0;
+        s->clut.lookup.reset();
+        /* most recently used to the front, trim() drops from the back */
+        m_entries.splice(m_entries.begin(), m_entries, it);
+        m_reused++;
+        return it->surface;
+    }
+
+    gSurface *s = new gSurface();
+    s->x = shape.x;
+    s->y = shape.y;
+    s->bpp = shape.bpp;
+    s->bypp = shape.bypp;
+    s->stride = shape.stride;
+    s->data = new unsigned char[capacity];
+    Entry e = { std::shared_ptr<gSurface>(s), capacity };
+    m_entries.push_front(e);
+    m_allocated++;
+    trim();
+    return m_entries.front().surface;
+}
+
+void SurfacePool::setLimit(size_t limit)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_limit = limit;
+    trim();
+}
+
+/* release the least recently used free surfaces beyond the limit */
+void SurfacePool::trim()
+{
+    size_t idle = 0;
+    for (std::list<Entry>::iterator it = m_entries.begin(); it != m_entries.end(); )
+    {
+        if (it->surface.use_count() == 1 && (idle += it->capacity) > m_limit)
+            it = m_entries.erase(it);
+        else
+            ++it;
+    }
+}
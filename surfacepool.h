@@ -0,0 +1,65 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SURFACEPOOL_H_
+#define _SURFACEPOOL_H_
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include "upng.h"
+
+/*
+ * Recycles decoded image surfaces. A surface handed out stays in the pool,
+ * once the pool holds its only reference it is free again and is reused
+ * for any image of the same size class, so a steady stream of images of
+ * similar size runs without allocating. Free surfaces beyond the idle
+ * limit are released.
+ */
+class SurfacePool
+{
+private:
+    struct Entry
+    {
+        std::shared_ptr<gSurface> surface;
+        size_t capacity; /* bytes of pixel data */
+    };
+
+    std::list<Entry> m_entries;
+    std::mutex m_lock;
+    size_t m_limit;
+    unsigned int m_reused, m_allocated;
+
+    static size_t sizeClass(size_t bytes);
+    void trim();
+
+public:
+    /* idle bytes kept for reuse */
+    SurfacePool(size_t limit);
+
+    /* the pool for all decoders of the process */
+    static SurfacePool &shared();
+
+    /* a width x height x bpp surface without a palette, the pixels are undefined */
+    std::shared_ptr<gSurface> get(int width, int height, int bpp);
+    void setLimit(size_t limit);
+
+    unsigned int reused() const { return m_reused; }
+    unsigned int allocated() const { return m_allocated; }
+};
+
+#endif
@@ -17,10 +17,18 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <cstring>
 #include <cstdint>
+#include <new>
 #include "erect.h"
 #include "upng.h"
+#include "imagecache.h"
+#include "imagedecoder.h"
+#include "surfacepool.h"
+#include "blend.h"
+#include "rgb565.h"
+#include "resample.h"
 
 #ifndef __DARWIN_LITTLE_ENDIAN
 #include <byteswap.h>
@@ -37,6 +45,8 @@ gUnmanagedSurface::gUnmanagedSurface():
     data(0),
     data_phys(0)
 {
+    clut.start = clut.colors = 0;
+    clut.data = 0;
 }
 
 gUnmanagedSurface::gUnmanagedSurface(int width, int height, int _bpp):
@@ -46,6 +56,8 @@ gUnmanagedSurface::gUnmanagedSurface(int width, int height, int _bpp):
     data(0),
     data_phys(0)
 {
+    clut.start = clut.colors = 0;
+    clut.data = 0;
     switch (_bpp)
     {
     case 8:
@@ -71,7 +83,7 @@ gSurface::gSurface(int width, int height, int _bpp):
 {
     if (!data)
     {
-        data = new unsigned char [y * stride];
+        data = new unsigned char [(size_t)y * stride];
     }
 }
 
@@ -89,174 +101,26 @@ gSurface::~gSurface()
 
 uPNG::uPNG()
 {
-	m_surface = NULL;
+	m_cache = NULL;
+	m_columnsSrc = m_columnsDst = m_columnsStart = 0;
 }
 uPNG::~uPNG()
 {
-	if(m_surface != NULL)
-		delete m_surface;
 }
 
-gUnmanagedSurface* uPNG::loadPNG(const char* filename)
+gSurface* uPNG::loadPNG(const char* filename)
 {
-    FILE *fp=fopen(filename, "rb");
-    unsigned char header[8];
-
-    
-    if (!fp)
-    {
-        printf("[uPNG] couldn't open %s\n", filename );
-        return NULL;
-    }
-    if (!fread(header, 8, 1, fp))
-    {
-        printf("[uPNG] couldn't read\n");
-        fclose(fp);
-        return NULL;
-    }
-    if (png_sig_cmp(header, 0, 8))
-    {
-        fclose(fp);
+    std::unique_ptr<ImageDecoder> decoder(ImageDecoder::open(filename));
+    if (!decoder)
         return NULL;
-    }
 
-    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
-    if (!png_ptr)
-    {
-        printf("[uPNG] failed to create read struct\n");
-        fclose(fp);
-        return NULL;
-    }
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
+    gSurface *surface = new gSurface(decoder->width(), decoder->height(), decoder->bpp());
+    if (!decoder->readImage(surface))
     {
-        printf("[uPNG] failed to create info struct\n");
-        png_destroy_read_struct(&png_ptr, (png_infopp)0, (png_infopp)0);
-        fclose(fp);
+        delete surface;
         return NULL;
     }
-    png_infop end_info = png_create_info_struct(png_ptr);
-    if (!end_info)
-    {
-        printf("[uPNG] failed to create end info struct\n");
-        png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-        fclose(fp);
-        return NULL;
-    }
-    if (setjmp(png_jmpbuf(png_ptr)))
-    {
-        printf("[uPNG] png setjump failed or activated\n");
-        png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-        fclose(fp);
-        return NULL;
-    }
-    png_init_io(png_ptr, fp);
-    png_set_sig_bytes(png_ptr, 8);
-    png_read_info(png_ptr, info_ptr);
-
-    png_uint_32 width, height;
-    int bit_depth;
-    int color_type;
-    int interlace_type;
-    int channels;
-    int trns;
-
-    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace_type, 0, 0);
-    channels = png_get_channels(png_ptr, info_ptr);
-    trns = png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS);
-    //eDebug("[ePNG] %s: before %dx%dx%dbpcx%dchan coltyp=%d", filename, (int)width, (int)height, bit_depth, channels, color_type);
-
-    /*
-     * gPixmaps use 8 bits per channel. rgb pixmaps are stored as abgr.
-     * So convert 1,2 and 4 bpc to 8bpc images that enigma can blit
-     * so add 'empty' alpha channel
-     * Expand G+tRNS to GA, RGB+tRNS to RGBA
-     */
-    if (bit_depth == 16)
-        png_set_strip_16(png_ptr);
-    if (bit_depth < 8)
-        png_set_packing (png_ptr);
-
-    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-        png_set_expand_gray_1_2_4_to_8(png_ptr);
-    if (color_type == PNG_COLOR_TYPE_GRAY && trns)
-        png_set_tRNS_to_alpha(png_ptr);
-    if ((color_type == PNG_COLOR_TYPE_GRAY && trns) || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
-        png_set_gray_to_rgb(png_ptr);
-        png_set_bgr(png_ptr);
-    }
-
-    if (color_type == PNG_COLOR_TYPE_RGB) {
-        if (trns)
-            png_set_tRNS_to_alpha(png_ptr);
-        else
-            png_set_add_alpha(png_ptr, 255, PNG_FILLER_AFTER);
-    }
-
-    if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_RGB_ALPHA)
-        png_set_bgr(png_ptr);
-
-    // Update the info structures after the transformations take effect
-    if (interlace_type != PNG_INTERLACE_NONE)
-        png_set_interlace_handling(png_ptr);  // needed before read_update_info()
-    png_read_update_info (png_ptr, info_ptr);
-    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, 0, 0, 0);
-    channels = png_get_channels(png_ptr, info_ptr);
-
-  //  result = new gPixmap(width, height, bit_depth * channels, cached ? PixmapCache::PixmapDisposed : NULL, accel);
-    gUnmanagedSurface *surface = new gSurface(width, height, bit_depth * channels);
-    
-    png_bytep *rowptr = new png_bytep[height];
-    for (unsigned int i = 0; i < height; i++)
-        rowptr[i] = ((png_byte*)(surface->data)) + i * surface->stride;
-    png_read_image(png_ptr, rowptr);
-
-    delete [] rowptr;
-
-    int num_palette = -1, num_trans = -1;
-    if (color_type == PNG_COLOR_TYPE_PALETTE) {
-        if (png_get_valid(png_ptr, info_ptr, PNG_INFO_PLTE)) {
-            png_color *palette;
-            png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette);
-            if (num_palette) {
-                surface->clut.data = new gRGB[num_palette];
-                surface->clut.colors = num_palette;
-
-                for (int i = 0; i < num_palette; i++) {
-                    surface->clut.data[i].a = 0;
-                    surface->clut.data[i].r = palette[i].red;
-                    surface->clut.data[i].g = palette[i].green;
-                    surface->clut.data[i].b = palette[i].blue;
-                }
-
-                if (trns) {
-                    png_byte *trans;
-                    png_get_tRNS(png_ptr, info_ptr, &trans, &num_trans, 0);
-                    for (int i = 0; i < num_trans; i++)
-                        surface->clut.data[i].a = 255 - trans[i];
-                    for (int i = num_trans; i < num_palette; i++)
-                        surface->clut.data[i].a = 0;
-                }
-
-            }
-            else {
-                surface->clut.data = 0;
-                surface->clut.colors = num_palette;
-            }
-        }
-        else {
-            surface->clut.data = 0;
-            surface->clut.colors = 0;
-        }
-        surface->clut.start = 0;
-    }
-
-
-//    printf("[uPNG] %s: after  %dx%dx%dbpcx%dchan coltyp=%d cols=%d trans=%d\n", filename, (int)width, (int)height, bit_depth, channels, color_type, num_palette, num_trans);
-
-    png_read_end(png_ptr, end_info);
-    png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-    fclose(fp);
+    decoder->getPalette(surface);
     return surface;
 }
 
@@ -279,59 +143,132 @@ static inline void blit_8i_to_32_at(uint32_t *dst, const uint8_t *src, const uin
     }
 }
 
-static inline void blit_8i_to_16(uint16_t *dst, const uint8_t *src, const uint32_t *pal, int width)
+static inline void blit_8i_to_16(uint16_t *dst, const uint8_t *src, const uint16_t *pal, int width)
 {
     while (width--)
-        *dst++=pal[*src++] & 0xFFFF;
+        *dst++=pal[*src++];
 }
 
-static inline void blit_8i_to_16_at(uint16_t *dst, const uint8_t *src, const uint32_t *pal, int width)
+static inline void blit_8i_to_16_at(uint16_t *dst, const uint8_t *src, const uint16_t *pal, const uint8_t *alpha, int width)
 {
     while (width--)
     {
-        if (!(pal[*src]&0x80000000))
+        if (!(alpha[*src]&0x80))
         {
             src++;
             dst++;
         } else
-            *dst++=pal[*src++] & 0xFFFF;
+            *dst++=pal[*src++];
     }
 }
 
-static void blit_8i_to_32_ab(gRGB *dst, const uint8_t *src, const gRGB *pal, int width)
+/* index to gray, a palette panel keeps the indices */
+static inline void blit_8i_to_8(uint8_t *dst, const uint8_t *src, const uint8_t *gray, int width)
+{
+    while (width--)
+        *dst++=gray[*src++];
+}
+
+static inline void blit_8i_to_8_at(uint8_t *dst, const uint8_t *src, const uint8_t *gray, const uint8_t *alpha, int width)
 {
     while (width--)
     {
-        dst->alpha_blend(pal[*src++]);
+        if (!(alpha[*src]&0x80))
+        {
+            src++;
+            dst++;
+        } else
+            *dst++=gray[*src++];
+    }
+}
+
+static inline void blit_8i_to_8_ab(uint8_t *dst, const uint8_t *src, const uint8_t *gray, const uint8_t *alpha, int width)
+{
+    while (width--)
+    {
+        int a = alpha[*src];
+        int g = gray[*src++];
+        /* opaque pixels are copied, so gray images come out unchanged */
+        if (a == 255)
+            *dst = g;
+        else if (a)
+            *dst = *dst + (((g - *dst) * a) >> 8);
         ++dst;
     }
 }
 
-static void convert_palette(uint32_t* pal, const gPalette& clut)
+/* the source pixel of every destination pixel, xtab from uPNG::scaleColumns */
+static inline void gather_8(uint8_t *dst, const uint8_t *src, const int *xtab, int width)
 {
-    int i = 0;
-    if (clut.data)
+    while (width--)
+        *dst++=src[*xtab++];
+}
+
+static inline void gather_32(uint32_t *dst, const uint32_t *src, const int *xtab, int width)
+{
+    while (width--)
+        *dst++=src[*xtab++];
+}
+
+/* pos = i * num / den for i = start, start + 1, .. without dividing, den > 0 */
+struct ScaleStep
+{
+    int pos, rem;
+    const int quot, frac, den;
+    ScaleStep(int num, int den, int start = 0): pos((int64_t)start * num / den), rem((int64_t)start * num % den),
+        quot(num / den), frac(num % den), den(den) {}
+    void next()
     {
-        while (i < clut.colors)
+        pos += quot;
+        rem += frac;
+        if (rem >= den)
         {
-            pal[i] = clut.data[i].argb() ^ 0xFF000000;
-            ++i;
+            rem -= den;
+            pos++;
         }
     }
-    for(; i != 256; ++i)
+};
+
+gLookup::gLookup(const gRGB *data, int colors)
+{
+    for (int i = 0; i != 256; ++i)
     {
-        pal[i] = (0x010101*i) | 0xFF000000;
+        /* gRGB alpha 0 is opaque */
+        uint32_t icol = data && i < colors ? data[i].argb() : 0x010101 * i;
+        int r = (icol >> 16) & 0xFF, g = (icol >> 8) & 0xFF, b = icol & 0xFF;
+        argb[i] = icol ^ 0xFF000000;
+#if BYTE_ORDER == LITTLE_ENDIAN
+        rgb565[i] = bswap_16(((icol & 0xFF) >> 3) << 11 | ((icol & 0xFF00) >> 10) << 5 | (icol & 0xFF0000) >> 19);
+#else
+        rgb565[i] = ((icol & 0xFF) >> 3) << 11 | ((icol & 0xFF00) >> 10) << 5 | (icol & 0xFF0000) >> 19;
+#endif
+        gray[i] = (r * 77 + g * 150 + b * 29 + 128) >> 8;
+        alpha[i] = argb[i] >> 24;
     }
 }
 
+/* the tables of src, surfaces that come without one get them built in arena */
+static const gLookup &lookupFor(const gUnmanagedSurface *src, FrameArena &arena)
+{
+    static const gLookup gray(NULL, 0);
+    if (src->clut.lookup)
+        return *src->clut.lookup;
+    if (!src->clut.data)
+        return gray;
+    return *new (arena.alloc(sizeof(gLookup))) gLookup(src->clut.data, src->clut.colors);
+}
+
 #define FIX 0x10000
 
 
 int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, const eRect &_pos, /*const gRegion &clip, */int flag)
 {
+    FrameArena::Scope scope(m_arena);
     eRect pos = _pos;
     eSize src_size = eSize(src_w,src_h);
 
+    m_dirty = eRect();
+
 //    eDebug("[gPixmap] source size: %d %d", src.size().width(), src.size().height());
 
     int scale_x = FIX, scale_y = FIX;
@@ -399,49 +336,66 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
       
         //  area&=clip.rects[i];
         
-        area&=eRect(ePoint(0, 0), src_size);
+        area&=eRect(0, 0, surface->x, surface->y);
 
         if (area.empty())
             continue;
 
+        m_dirty |= area;
+
         eRect srcarea = area;
         srcarea.moveBy(-pos.x(), -pos.y());
 
 //        eDebug("[gPixmap] srcarea before scale: %d %d %d %d",
 //            srcarea.x(), srcarea.y(), srcarea.width(), srcarea.height());
 
-        if (flag & blitScale)
-            srcarea = eRect(srcarea.x() * FIX / scale_x, srcarea.y() * FIX / scale_y, srcarea.width() * FIX / scale_x, srcarea.height() * FIX / scale_y);
 
 //        eDebug("[gPixmap] srcarea after scale: %d %d %d %d",
 //            srcarea.x(), srcarea.y(), srcarea.width(), srcarea.height());
 
 
+        if ((flag & blitScale) && (flag & (blitScaleBilinear | blitScaleArea)) && surface->bpp != 8
+            && (m_surface->bpp == 32 || m_surface->bpp == 8))
+        {
+            /* filter the visible part into a 32bpp image, that is blitted unscaled */
+            eRect part = area;
+            part.moveBy(-pos.x(), -pos.y());
+            std::shared_ptr<gSurface> out = SurfacePool::shared().get(part.width(), part.height(), 32);
+            const uint32_t *pal = m_surface->bpp == 8 ? lookupFor(m_surface.get(), m_arena).argb : NULL;
+            resample(m_surface.get(), pal, src_w, src_h, pos.width(), pos.height(), part, out.get(), flag, m_arena);
+            std::shared_ptr<gUnmanagedSurface> image = m_surface;
+            m_surface = out;
+            int ret = blit(surface, part.width(), part.height(), area, flag & (blitAlphaTest | blitAlphaBlend));
+            m_surface = image;
+            if (ret != 0)
+                return ret;
+            continue;
+        }
+
         if (flag & blitScale)
         {
             if ((surface->bpp == 32) && (m_surface->bpp==8))
             {
                 const uint8_t *srcptr = (uint8_t*)m_surface->data;
                 uint8_t *dstptr=(uint8_t*)surface->data; // !!
-                uint32_t pal[256];
-                convert_palette(pal, m_surface->clut);
+                const uint32_t *pal = lookupFor(m_surface.get(), m_arena).argb;
 
                 const int src_stride = m_surface->stride;
-                srcptr += srcarea.left()*m_surface->bypp + srcarea.top()*src_stride;
                 dstptr += area.left()*surface->bypp + area.top()*surface->stride;
                 const int width = area.width();
                 const int height = area.height();
-                const int src_height = srcarea.height();
-                const int src_width = srcarea.width();
+                const int top = area.top() - pos.top();
+                const int *xtab = scaleColumns(src_w, pos.width(), area.left() - pos.left(), width);
                 if (flag & blitAlphaTest)
                 {
-                    for (int y = 0; y < height; ++y)
+                    ScaleStep sy(src_h, pos.height(), top);
+                    for (int y = 0; y < height; ++y, sy.next())
                     {
-                        const uint8_t *src_row_ptr = srcptr + (((y * src_height) / height) * src_stride);
+                        const uint8_t *src_row_ptr = srcptr + sy.pos * src_stride;
                         uint32_t *dst = (uint32_t*)dstptr;
                         for (int x = 0; x < width; ++x)
                         {
-                            uint32_t pixel = pal[src_row_ptr[(x *src_width) / width]];
+                            uint32_t pixel = pal[src_row_ptr[xtab[x]]];
                             if (pixel & 0x80000000)
                                 *dst = pixel;
                             ++dst;
@@ -451,13 +405,14 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
                 }
                 else if (flag & blitAlphaBlend)
                 {
-                    for (int y = 0; y < height; ++y)
+                    ScaleStep sy(src_h, pos.height(), top);
+                    for (int y = 0; y < height; ++y, sy.next())
                     {
-                        const uint8_t *src_row_ptr = srcptr + (((y * src_height) / height) * src_stride);
+                        const uint8_t *src_row_ptr = srcptr + sy.pos * src_stride;
                         gRGB *dst = (gRGB*)dstptr;
                         for (int x = 0; x < width; ++x)
                         {
-                            dst->alpha_blend(pal[src_row_ptr[(x * src_width) / width]]);
+                            dst->alpha_blend(pal[src_row_ptr[xtab[x]]]);
                             ++dst;
                         }
                         dstptr += surface->stride;
@@ -465,13 +420,14 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
                 }
                 else
                 {
-                    for (int y = 0; y < height; ++y)
+                    ScaleStep sy(src_h, pos.height(), top);
+                    for (int y = 0; y < height; ++y, sy.next())
                     {
-                        const uint8_t *src_row_ptr = srcptr + (((y * src_height) / height) * src_stride);
+                        const uint8_t *src_row_ptr = srcptr + sy.pos * src_stride;
                         uint32_t *dst = (uint32_t*)dstptr;
                         for (int x = 0; x < width; ++x)
                         {
-                            *dst = pal[src_row_ptr[(x * src_width) / width]];
+                            *dst = pal[src_row_ptr[xtab[x]]];
                             ++dst;
                         }
                         dstptr += surface->stride;
@@ -481,21 +437,22 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
             else if ((surface->bpp == 32) && (m_surface->bpp == 32))
             {
                 const int src_stride = m_surface->stride;
-                const uint8_t* srcptr = (const uint8_t*)m_surface->data + srcarea.left()*m_surface->bypp + srcarea.top()*src_stride;
+                const uint8_t* srcptr = (const uint8_t*)m_surface->data;
                 uint8_t* dstptr = (uint8_t*)surface->data + area.left()*surface->bypp + area.top()*surface->stride;
                 const int width = area.width();
                 const int height = area.height();
-                const int src_height = srcarea.height();
-                const int src_width = srcarea.width();
+                const int top = area.top() - pos.top();
+                const int *xtab = scaleColumns(src_w, pos.width(), area.left() - pos.left(), width);
                 if (flag & blitAlphaTest)
                 {
-                    for (int y = 0; y < height; ++y)
+                    ScaleStep sy(src_h, pos.height(), top);
+                    for (int y = 0; y < height; ++y, sy.next())
                     {
-                        const uint32_t *src_row_ptr = (uint32_t*)(srcptr + (((y * src_height) / height) * src_stride));
+                        const uint32_t *src_row_ptr = (uint32_t*)(srcptr + sy.pos * src_stride);
                         uint32_t *dst = (uint32_t*)dstptr;
                         for (int x = 0; x < width; ++x)
                         {
-                            uint32_t pixel = src_row_ptr[(x *src_width) / width];
+                            uint32_t pixel = src_row_ptr[xtab[x]];
                             if (pixel & 0x80000000)
                                 *dst = pixel;
                             ++dst;
@@ -505,13 +462,14 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
                 }
                 else if (flag & blitAlphaBlend)
                 {
-                    for (int y = 0; y < height; ++y)
+                    ScaleStep sy(src_h, pos.height(), top);
+                    for (int y = 0; y < height; ++y, sy.next())
                     {
-                        const gRGB *src_row_ptr = (gRGB *)(srcptr + (((y * src_height) / height) * src_stride));
+                        const gRGB *src_row_ptr = (gRGB *)(srcptr + sy.pos * src_stride);
                         gRGB *dst = (gRGB*)dstptr;
                         for (int x = 0; x < width; ++x)
                         {
-                            dst->alpha_blend(src_row_ptr[(x * src_width) / width]);
+                            dst->alpha_blend(src_row_ptr[xtab[x]]);
                             ++dst;
                         }
                         dstptr += surface->stride;
@@ -519,19 +477,55 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
                 }
                 else
                 {
-                    for (int y = 0; y < height; ++y)
+                    ScaleStep sy(src_h, pos.height(), top);
+                    for (int y = 0; y < height; ++y, sy.next())
                     {
-                        const uint32_t *src_row_ptr = (uint32_t*)(srcptr + (((y * src_height) / height) * src_stride));
+                        const uint32_t *src_row_ptr = (uint32_t*)(srcptr + sy.pos * src_stride);
                         uint32_t *dst = (uint32_t*)dstptr;
                         for (int x = 0; x < width; ++x)
                         {
-                            *dst = src_row_ptr[(x * src_width) / width];
+                            *dst = src_row_ptr[xtab[x]];
                             ++dst;
                         }
                         dstptr += surface->stride;
                     }
                 }
             }
+            else if (((surface->bpp == 8) && (m_surface->bpp == 8)) || ((surface->bpp == 16) && (m_surface->bpp == 8 || m_surface->bpp == 32)))
+            {
+                /* pick the visible pixels into an image of the source format, the unscaled blit does the rest */
+                const int width = area.width();
+                const int height = area.height();
+                const int src_stride = m_surface->stride;
+                const uint8_t *srcptr = (const uint8_t*)m_surface->data;
+                std::shared_ptr<gSurface> picked = SurfacePool::shared().get(width, height, m_surface->bpp);
+                uint8_t *dstptr = (uint8_t*)picked->data;
+                const int *xtab = scaleColumns(src_w, pos.width(), area.left() - pos.left(), width);
+                ScaleStep sy(src_h, pos.height(), area.top() - pos.top());
+                for (int y = 0, last = -1; y < height; ++y, sy.next())
+                {
+                    /* enlarging repeats source rows */
+                    if (sy.pos == last)
+                        memcpy(dstptr, dstptr - picked->stride, width*picked->bypp);
+                    else if (m_surface->bpp == 8)
+                        gather_8(dstptr, srcptr + sy.pos * src_stride, xtab, width);
+                    else
+                        gather_32((uint32_t*)dstptr, (const uint32_t*)(srcptr + sy.pos * src_stride), xtab, width);
+                    last = sy.pos;
+                    dstptr += picked->stride;
+                }
+                /* lent for the blit, the pool would free a palette it finds */
+                picked->clut = m_surface->clut;
+                std::shared_ptr<gUnmanagedSurface> image = m_surface;
+                m_surface = picked;
+                int ret = blit(surface, width, height, area, flag & (blitAlphaTest | blitAlphaBlend));
+                m_surface = image;
+                picked->clut.data = 0;
+                picked->clut.start = picked->clut.colors = 0;
+                picked->clut.lookup.reset();
+                if (ret != 0)
+                    return ret;
+            }
             else
             {
                 printf("[uPNG] unimplemented: scale on non-accel surface %d->%d bpp\n", m_surface->bpp, surface->bpp);
@@ -543,43 +537,30 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
         {
             uint8_t *srcptr=(uint8_t*)m_surface->data;
             uint8_t *dstptr=(uint8_t*)surface->data;
+            const gLookup &lut = lookupFor(m_surface.get(), m_arena);
+            /* a palette panel takes the indices, it can only alpha test */
+            const bool indexed = surface->clut.data != 0;
+            static const struct Identity
+            {
+                uint8_t index[256];
+                Identity() { for (int i = 0; i != 256; ++i) index[i] = i; }
+            } identity;
+            const uint8_t *gray = indexed ? identity.index : lut.gray;
 
             srcptr+=srcarea.left()*m_surface->bypp+srcarea.top()*m_surface->stride;
             dstptr+=area.left()*surface->bypp+area.top()*surface->stride;
-            if (flag & (blitAlphaTest|blitAlphaBlend))
-            {
-                for (int y = area.height(); y != 0; --y)
-                {
-                    // no real alphatest yet
-                    int width=area.width();
-                    unsigned char *s = (unsigned char*)srcptr;
-                    unsigned char *d = (unsigned char*)dstptr;
-                    // use duff's device here!
-                    while (width--)
-                    {
-                        if (!*s)
-                        {
-                            s++;
-                            d++;
-                        }
-                        else
-                        {
-                            *d++ = *s++;
-                        }
-                    }
-                    srcptr += m_surface->stride;
-                    dstptr += surface->stride;
-                }
-            }
-            else
+            for (int y = area.height(); y != 0; --y)
             {
-                int linesize = area.width()*surface->bypp;
-                for (int y = area.height(); y != 0; --y)
-                {
-                    memcpy(dstptr, srcptr, linesize);
-                    srcptr += m_surface->stride;
-                    dstptr += surface->stride;
-                }
+                if ((flag & blitAlphaTest) || ((flag & blitAlphaBlend) && indexed))
+                    blit_8i_to_8_at(dstptr, srcptr, gray, lut.alpha, area.width());
+                else if (flag & blitAlphaBlend)
+                    blit_8i_to_8_ab(dstptr, srcptr, gray, lut.alpha, area.width());
+                else if (indexed || !m_surface->clut.data)
+                    memcpy(dstptr, srcptr, area.width());
+                else
+                    blit_8i_to_8(dstptr, srcptr, gray, area.width());
+                srcptr += m_surface->stride;
+                dstptr += surface->stride;
             }
         }
         else if ((surface->bpp == 32) && (m_surface->bpp==32))
@@ -607,16 +588,7 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
                             *dst++=*src++;
                     }
                 } else if (flag & blitAlphaBlend)
-                {
-                    int width = area.width();
-                    gRGB *src = (gRGB*)srcptr;
-                    gRGB *dst = (gRGB*)dstptr;
-                    while (width--)
-                    {
-                        dst->alpha_blend(*src++);
-                        ++dst;
-                    }
-                }
+                    blend_32_to_32((gRGB*)dstptr, (const gRGB*)srcptr, area.width());
                 else
                     memcpy(dstptr, srcptr, area.width()*surface->bypp);
                 srcptr = (uint32_t*)((uint8_t*)srcptr + m_surface->stride);
@@ -627,8 +599,7 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
         {
             const uint8_t *srcptr = (uint8_t*)m_surface->data;
             uint8_t *dstptr=(uint8_t*)surface->data; // !!
-            uint32_t pal[256];
-            convert_palette(pal, m_surface->clut);
+            const uint32_t *pal = lookupFor(m_surface.get(), m_arena).argb;
 
             srcptr+=srcarea.left()*m_surface->bypp+srcarea.top()*m_surface->stride;
             dstptr+=area.left()*surface->bypp+area.top()*surface->stride;
@@ -638,7 +609,7 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
                 if (flag & blitAlphaTest)
                     blit_8i_to_32_at((uint32_t*)dstptr, srcptr, pal, width);
                 else if (flag & blitAlphaBlend)
-                    blit_8i_to_32_ab((gRGB*)dstptr, srcptr, (const gRGB*)pal, width);
+                    blend_8i_to_32((gRGB*)dstptr, srcptr, pal, width);
                 else
                     blit_8i_to_32((uint32_t*)dstptr, srcptr, pal, width);
                 srcptr += m_surface->stride;
@@ -649,38 +620,22 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
         {
             uint8_t *srcptr=(uint8_t*)m_surface->data;
             uint8_t *dstptr=(uint8_t*)surface->data; // !!
-            uint32_t pal[256];
-
-            for (int i=0; i != 256; ++i)
-            {
-                uint32_t icol;
-                if (m_surface->clut.data && (i<m_surface->clut.colors))
-                    icol = m_surface->clut.data[i].argb();
-                else
-                    icol=0x010101*i;
-#if BYTE_ORDER == LITTLE_ENDIAN
-                pal[i] = bswap_16(((icol & 0xFF) >> 3) << 11 | ((icol & 0xFF00) >> 10) << 5 | (icol & 0xFF0000) >> 19);
-#else
-                pal[i] = ((icol & 0xFF) >> 3) << 11 | ((icol & 0xFF00) >> 10) << 5 | (icol & 0xFF0000) >> 19;
-#endif
-                pal[i]^=0xFF000000;
-            }
+            const gLookup &lut = lookupFor(m_surface.get(), m_arena);
 
             srcptr+=srcarea.left()*m_surface->bypp+srcarea.top()*m_surface->stride;
             dstptr+=area.left()*surface->bypp+area.top()*surface->stride;
 
-            if (flag & blitAlphaBlend)
-                printf("[uPNG] ignore unsupported 8bpp -> 16bpp alphablend!\n");
-
             for (int y=0; y<area.height(); y++)
             {
                 int width=area.width();
                 unsigned char *psrc=(unsigned char*)srcptr;
                 uint16_t *dst=(uint16_t*)dstptr;
-                if (flag & blitAlphaTest)
-                    blit_8i_to_16_at(dst, psrc, pal, width);
+                if (flag & blitAlphaBlend)
+                    blend_8i_to_16(dst, psrc, lut.argb, width);
+                else if (flag & blitAlphaTest)
+                    blit_8i_to_16_at(dst, psrc, lut.rgb565, lut.alpha, width);
                 else
-                    blit_8i_to_16(dst, psrc, pal, width);
+                    blit_8i_to_16(dst, psrc, lut.rgb565, width);
                 srcptr+=m_surface->stride;
                 dstptr+=surface->stride;
             }
@@ -700,72 +655,11 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
                 uint16_t *dstp=(uint16_t*)dstptr;
 
                 if (flag & blitAlphaBlend)
-                {
-                    while (width--)
-                    {
-                        if (!((*srcp)&0xFF000000))
-                        {
-                            srcp++;
-                            dstp++;
-                        } else
-                        {
-                            gRGB icol = *srcp++;
-#if BYTE_ORDER == LITTLE_ENDIAN
-                            uint32_t jcol = bswap_16(*dstp);
-#else
-                            uint32_t jcol = *dstp;
-#endif
-                            int bg_b = (jcol >> 8) & 0xF8;
-                            int bg_g = (jcol >> 3) & 0xFC;
-                            int bg_r = (jcol << 3) & 0xF8;
-
-                            int a = icol.a;
-                            int r = icol.r;
-                            int g = icol.g;
-                            int b = icol.b;
-
-                            r = ((r-bg_r)*a)/255 + bg_r;
-                            g = ((g-bg_g)*a)/255 + bg_g;
-                            b = ((b-bg_b)*a)/255 + bg_b;
-
-#if BYTE_ORDER == LITTLE_ENDIAN
-                            *dstp++ = bswap_16( (b >> 3) << 11 | (g >> 2) << 5 | r  >> 3 );
-#else
-                            *dstp++ = (b >> 3) << 11 | (g >> 2) << 5 | r  >> 3 ;
-#endif
-                        }
-                    }
-                }
+                    blend_32_to_16(dstp, srcp, width);
                 else if (flag & blitAlphaTest)
-                {
-                    while (width--)
-                    {
-                        if (!((*srcp)&0xFF000000))
-                        {
-                            srcp++;
-                            dstp++;
-                        } else
-                        {
-                            uint32_t icol = *srcp++;
-#if BYTE_ORDER == LITTLE_ENDIAN
-                            *dstp++ = bswap_16(((icol & 0xFF) >> 3) << 11 | ((icol & 0xFF00) >> 10) << 5 | (icol & 0xFF0000) >> 19);
-#else
-                            *dstp++ = ((icol & 0xFF) >> 3) << 11 | ((icol & 0xFF00) >> 10) << 5 | (icol & 0xFF0000) >> 19;
-#endif
-                        }
-                    }
-                } else
-                {
-                    while (width--)
-                    {
-                        uint32_t icol = *srcp++;
-#if BYTE_ORDER == LITTLE_ENDIAN
-                        *dstp++ = bswap_16(((icol & 0xFF) >> 3) << 11 | ((icol & 0xFF00) >> 10) << 5 | (icol & 0xFF0000) >> 19);
-#else
-                        *dstp++ = ((icol & 0xFF) >> 3) << 11 | ((icol & 0xFF00) >> 10) << 5 | (icol & 0xFF0000) >> 19;
-#endif
-                    }
-                }
+                    blit_32_to_16_at(dstp, srcp, width);
+                else
+                    blit_32_to_16(dstp, srcp, width);
                 srcptr+=m_surface->stride;
                 dstptr+=surface->stride;
             }
@@ -778,13 +672,313 @@ int uPNG::blit(gUnmanagedSurface * surface, const int src_w, const int src_h, co
     return 0;
 }
 
+/*
+ * The source column of destination columns [from, from + count) when
+ * src_width columns are scaled to width, the same blit again reuses it.
+ */
+const int *uPNG::scaleColumns(int src_width, int width, int from, int count)
+{
+    if (m_columnsSrc != src_width || m_columnsDst != width || m_columnsStart != from || (int)m_columns.size() != count)
+    {
+        m_columns.resize(count);
+        ScaleStep sx(src_width, width, from);
+        for (int x = 0; x < count; x++, sx.next())
+            m_columns[x] = sx.pos;
+        m_columnsSrc = src_width;
+        m_columnsDst = width;
+        m_columnsStart = from;
+    }
+    return &m_columns[0];
+}
+
+int uPNG::blitFrom(const gUnmanagedSurface *src, gUnmanagedSurface *surface, const eRect &pos, int flag)
+{
+    /* a plain gUnmanagedSurface never frees the pixels it points to */
+    if (!m_view)
+        m_view.reset(new gUnmanagedSurface());
+    *m_view = *src;
+    m_surface = m_view;
+    int ret = blit(surface, src->x, src->y, pos, flag);
+    m_surface.reset();
+    m_view->clut.lookup.reset();
+    return ret;
+}
+
+/*
+ * Decode a few rows at a time and blit them right away, the image is never
+ * held in memory as a whole. Only for unscaled, unaligned blits.
+ */
+int uPNG::renderRows(ImageDecoder &decoder, int posX, int posY, gUnmanagedSurface* surface, int flag)
+{
+    const int rows = 16;
+    int first, end;
+
+    m_dirty = eRect();
+    if (!visibleRows(decoder, posX, posY, surface, first, end))
+        return 0;
+
+    std::shared_ptr<gSurface> strip = SurfacePool::shared().get(decoder.width(), rows, decoder.bpp());
+    decoder.getPalette(strip.get());
+    m_surface = strip;
+
+    /* rows above the panel still have to go through zlib, they are just not drawn */
+    eRect dirty;
+    for (int y = 0; y < end; )
+    {
+        int stop = y < first ? first : end;
+        int count = stop - y < rows ? stop - y : rows;
+        if (!decoder.readRows((unsigned char *)strip->data, strip->stride, count)
+            || (y >= first && blit(surface, strip->x, count, eRect(posX, posY + y, strip->x, count), flag) != 0))
+        {
+            /* the rows drawn so far stay in the destination */
+            m_dirty = dirty;
+            m_surface.reset();
+            return -1;
+        }
+        if (y >= first)
+            dirty |= m_dirty;
+        y += count;
+    }
+    /* the rows below the panel are never decoded */
+    m_dirty = dirty;
+    m_surface.reset();
+    return 0;
+}
+
+/* the source rows [first, end) of an unscaled blit at posX, posY land on surface */
+bool uPNG::visibleRows(const ImageDecoder &decoder, int posX, int posY, const gUnmanagedSurface* surface, int &first, int &end)
+{
+    first = posY < 0 ? -posY : 0;
+    end = surface->y - posY < decoder.height() ? surface->y - posY : decoder.height();
+    return first < end && posX < surface->x && posX + decoder.width() > 0;
+}
+
+/* the destination rect of a scaled blit, as worked out by blit() */
+static eRect scaleTarget(int src_w, int src_h, const eRect &_pos, int flag)
+{
+    eRect pos = _pos;
+    if (flag & uPNG::blitKeepAspectRatio)
+    {
+        int scale_x = _pos.width() * FIX / src_w;
+        int scale_y = _pos.height() * FIX / src_h;
+        if (scale_x > scale_y)
+        {
+            pos.setWidth(src_w * _pos.height() / src_h);
+            if (flag & uPNG::blitHAlignCenter)
+                pos.moveBy((_pos.width() - pos.width()) / 2, 0);
+            else if (flag & uPNG::blitHAlignRight)
+                pos.moveBy(_pos.width() - pos.width(), 0);
+        }
+        else
+        {
+            pos.setHeight(src_h * _pos.width() / src_w);
+            if (flag & uPNG::blitVAlignCenter)
+                pos.moveBy(0, (_pos.height() - pos.height()) / 2);
+            else if (flag & uPNG::blitVAlignBottom)
+                pos.moveBy(0, _pos.height() - pos.height());
+        }
+    }
+    return pos;
+}
+
+/*
+ * Shrink while decoding, every source row is folded into its output row
+ * right away, so only one source row and the output image are in memory.
+ * Colour is box filtered with alpha weighting, palette images drawn on a
+ * palette surface take the nearest pixel and keep their indices.
+ */
+int uPNG::renderReduced(ImageDecoder &decoder, const eRect &pos, gUnmanagedSurface* surface, int flag)
+{
+    const int sw = decoder.width(), sh = decoder.height();
+    const int dw = pos.width(), dh = pos.height();
+    const bool nearest = decoder.bpp() == 8 && surface->bpp == 8;
+
+    std::shared_ptr<gSurface> row = SurfacePool::shared().get(sw, 1, decoder.bpp());
+    decoder.getPalette(row.get());
+    std::shared_ptr<gSurface> out = SurfacePool::shared().get(dw, dh, nearest ? 8 : 32);
+    const uint32_t *pal = lookupFor(row.get(), m_arena).argb;
+    if (nearest)
+        decoder.getPalette(out.get());
+
+    int *column = m_arena.alloc<int>(sw); /* output column of every source column */
+    int *count = m_arena.alloc<int>(dw);  /* source columns per output column */
+    memset(count, 0, dw * sizeof(int));
+    ScaleStep cx(dw, sw);
+    for (int x = 0; x < sw; x++, cx.next())
+    {
+        column[x] = cx.pos;
+        count[column[x]]++;
+    }
+    const int *xtab = nearest ? scaleColumns(sw, dw, 0, dw) : NULL;
+    uint64_t *acc = nearest ? NULL : m_arena.alloc<uint64_t>(dw * 4);
+    if (acc)
+        memset(acc, 0, dw * 4 * sizeof(uint64_t));
+
+    int ret = 0, band = 0, oy = 0;
+    ScaleStep sy(dh, sh);
+    /* nearest: the source row of output row picked, dh <= sh picks every source row at most once */
+    ScaleStep ny(sh, dh);
+    int picked = 0;
+    for (int y = 0; y < sh; y++)
+    {
+        sy.next(); /* output row of source row y + 1 */
+        if (!decoder.readRows((unsigned char *)row->data, row->stride, 1))
+        {
+            ret = -1;
+            break;
+        }
+        const uint8_t *src = (const uint8_t *)row->data;
+        uint8_t *dst = (uint8_t *)out->data + oy * out->stride;
+        band++;
+        bool last = y + 1 == sh || sy.pos != oy;
+
+        if (nearest)
+        {
+            /* source row floor(row * sh / dh) of every output row, like blit() */
+            if (picked < dh && y == ny.pos)
+            {
+                uint8_t *line = (uint8_t *)out->data + picked * out->stride;
+                for (int x = 0; x < dw; x++)
+                    line[x] = src[xtab[x]];
+                picked++;
+                ny.next();
+            }
+        }
+        else
+        {
+            for (int x = 0; x < sw; x++)
+            {
+                uint8_t px[4];
+                if (decoder.bpp() == 8)
+                    memcpy(px, &pal[src[x]], 4);
+                else
+                    memcpy(px, src + x * 4, 4);
+                uint64_t *a = acc + column[x] * 4;
+                a[0] += px[0] * px[3];
+                a[1] += px[1] * px[3];
+                a[2] += px[2] * px[3];
+                a[3] += px[3];
+            }
+            if (last)
+            {
+                for (int x = 0; x < dw; x++)
+                {
+                    uint64_t *a = acc + x * 4;
+                    uint64_t n = (uint64_t)count[x] * band;
+                    uint8_t *px = dst + x * 4;
+                    if (a[3])
+                    {
+                        px[0] = (a[0] + a[3] / 2) / a[3];
+                        px[1] = (a[1] + a[3] / 2) / a[3];
+                        px[2] = (a[2] + a[3] / 2) / a[3];
+                        px[3] = (a[3] + n / 2) / n;
+                    }
+                    else
+                        memset(px, 0, 4);
+                }
+                memset(acc, 0, dw * 4 * sizeof(uint64_t));
+            }
+        }
+        if (last)
+        {
+            oy++;
+            band = 0;
+        }
+    }
+    if (ret != 0)
+        return ret;
+
+    m_surface = out;
+    return blit(surface, dw, dh, pos, flag & ~(blitScale | blitKeepAspectRatio | blitHAlignCenter | blitHAlignRight | blitVAlignCenter | blitVAlignBottom));
+}
+
+/* decode and blit, src keeps the decoded image if it was not streamed */
+int uPNG::renderDecoder(ImageDecoder &decoder, int posX, int posY, gUnmanagedSurface* surface, int width, int height, int flag, size_t keep, std::shared_ptr<gSurface> &src)
+{
+    if ((flag & blitScale) && !(flag & (blitScaleBilinear | blitScaleArea)) && !decoder.interlaced())
+    {
+        /* shrinking, there is no need for the full size image, filtering needs it */
+        eRect target = scaleTarget(decoder.width(), decoder.height(), eRect(posX, posY, width, height), flag);
+        if (!target.empty() && target.width() <= decoder.width() && target.height() <= decoder.height()
+            && target.size() != eSize(decoder.width(), decoder.height()))
+            return renderReduced(decoder, target, surface, flag);
+    }
+
+    /*
+     * Images that are not kept anyway go straight to the destination, and
+     * so do images that are mostly off the panel, only their visible rows
+     * are decoded.
+     */
+    size_t bytes = (size_t)decoder.height() * decoder.width() * (decoder.bpp() >> 3);
+    bool streamable = !decoder.interlaced() && !(flag & (blitScale | blitHAlignCenter | blitHAlignRight | blitVAlignCenter | blitVAlignBottom));
+    int first, end;
+    bool hidden = !visibleRows(decoder, posX, posY, surface, first, end) || (end - first) * 2 < decoder.height();
+    if (streamable && (bytes > keep || hidden))
+        return renderRows(decoder, posX, posY, surface, flag);
+
+    src = SurfacePool::shared().get(decoder.width(), decoder.height(), decoder.bpp());
+    if (!decoder.readImage(src.get()))
+    {
+        src.reset();
+        return -1;
+    }
+    decoder.getPalette(src.get());
+    m_surface = src;
+    return blit(surface, m_surface->x, m_surface->y, eRect(posX, posY, width, height), flag);
+}
+
+/*
+ * The decoded image is dropped after the blit, unless the cache keeps it,
+ * so its surface goes back to the pool for the next image.
+ */
 int uPNG::render(const char* filename, int posX, int posY, gUnmanagedSurface* surface, int width, int height, int bpp, int flag)
 {
+    struct stat st;
+    bool cached = m_cache && stat(filename, &st) == 0;
+    std::shared_ptr<gSurface> src;
+    int ret;
+
+    if (cached)
+        src = m_cache->find(filename, st.st_mtim, st.st_size);
+    if (src)
+    {
+        m_surface = src;
+        ret = blit(surface, m_surface->x, m_surface->y, eRect(posX, posY, width, height), flag);
+        m_surface.reset();
+        return ret;
+    }
 
-    m_surface = loadPNG(filename);
-	if (m_surface == NULL)
-		return -1;
+    FrameArena::Scope scope(m_arena);
+    std::unique_ptr<ImageDecoder> decoder(ImageDecoder::open(filename, &m_arena));
+    if (!decoder)
+        return -1;
+    ret = renderDecoder(*decoder, posX, posY, surface, width, height, flag, cached ? m_cache->budget() : 0, src);
+    m_surface.reset();
+    if (src && cached)
+        m_cache->insert(filename, st.st_mtim, st.st_size, src);
+    return ret;
+}
 
-    return blit(surface, width, height, eRect(0,0,width,height), flag);
+int uPNG::render(const void* data, size_t len, int posX, int posY, gUnmanagedSurface* surface, int width, int height, int bpp, int flag)
+{
+    std::shared_ptr<gSurface> src;
+    FrameArena::Scope scope(m_arena);
+    std::unique_ptr<ImageDecoder> decoder(ImageDecoder::open(data, len, &m_arena));
+    if (!decoder)
+        return -1;
+    int ret = renderDecoder(*decoder, posX, posY, surface, width, height, flag, 0, src);
+    m_surface.reset();
+    return ret;
 }
 
+int uPNG::renderFd(int fd, int posX, int posY, gUnmanagedSurface* surface, int width, int height, int bpp, int flag)
+{
+    std::shared_ptr<gSurface> src;
+    FrameArena::Scope scope(m_arena);
+    std::unique_ptr<ImageDecoder> decoder(ImageDecoder::openFd(fd, &m_arena));
+    if (!decoder)
+        return -1;
+    int ret = renderDecoder(*decoder, posX, posY, surface, width, height, flag, 0, src);
+    m_surface.reset();
+    return ret;
+}
@@ -22,7 +22,10 @@
 #include <png.h>
 #include <cstdint>
 #include <string>
+#include <memory>
+#include <vector>
 #include "erect.h"
+#include "framearena.h"
 
 struct gRGB
 {
@@ -140,10 +143,25 @@ struct gRGB
 };
 
 
+/*
+ * A palette in the pixel formats of the panels, built once per decoded
+ * image instead of on every blit. Entries past the palette are gray.
+ */
+struct gLookup
+{
+    uint32_t argb[256];   /* 32bpp, alpha 255 is opaque */
+    uint16_t rgb565[256]; /* 16bpp in panel byte order */
+    uint8_t gray[256];    /* 8bpp gray and mono panels */
+    uint8_t alpha[256];   /* 255 is opaque */
+
+    gLookup(const gRGB *data, int colors);
+};
+
 struct gPalette
 {
     int start, colors;
     gRGB *data;
+    std::shared_ptr<const gLookup> lookup; /* NULL is built when needed */
 };
 
 
@@ -168,6 +186,9 @@ private:
     gSurface& operator =(const gSurface&);
 };
 
+class ImageCache;
+class ImageDecoder;
+
 class uPNG
 {
 public:
@@ -181,19 +202,43 @@ public:
         blitHAlignCenter = 16,
         blitHAlignRight = 32,
         blitVAlignCenter = 64,
-        blitVAlignBottom = 128
+        blitVAlignBottom = 128,
+        /* blitScale filters instead of taking the nearest pixel, 16 and 32bpp destinations */
+        blitScaleBilinear = 256,
+        blitScaleArea = 512
     };
 
 	uPNG();
 	~uPNG();
-    gUnmanagedSurface* loadPNG(const char* filename);
+    gSurface* loadPNG(const char* filename);
 //	void blit(unsigned char* dest, int posX, int posY, int width, int height, int bpp, int flag);
 	int render(const char* filename, int posX, int posY, gUnmanagedSurface* dest, int width, int height, int bpp, int flag = blitAlphaTest);
+	/* the same for an image in memory or read from fd (stdin, a pipe), nothing is cached */
+	int render(const void* data, size_t len, int posX, int posY, gUnmanagedSurface* dest, int width, int height, int bpp, int flag = blitAlphaTest);
+	int renderFd(int fd, int posX, int posY, gUnmanagedSurface* dest, int width, int height, int bpp, int flag = blitAlphaTest);
 	
     int blit(gUnmanagedSurface * surface, const int src_w, const int src_h, const eRect &_pos, /*const gRegion &clip, */int flag);
+    /* blit src instead of the last image, src is used in place */
+    int blitFrom(const gUnmanagedSurface *src, gUnmanagedSurface *surface, const eRect &pos, int flag);
+    /* destination area touched by the last blit */
+    const eRect &dirtyRect() const { return m_dirty; }
+    /* decoded images are looked up in cache first, NULL decodes every time */
+    void setCache(ImageCache *cache) { m_cache = cache; }
     
 private:
-    gUnmanagedSurface *m_surface;
+    int renderRows(ImageDecoder &decoder, int posX, int posY, gUnmanagedSurface* surface, int flag);
+    static bool visibleRows(const ImageDecoder &decoder, int posX, int posY, const gUnmanagedSurface* surface, int &first, int &end);
+    int renderReduced(ImageDecoder &decoder, const eRect &pos, gUnmanagedSurface* surface, int flag);
+    int renderDecoder(ImageDecoder &decoder, int posX, int posY, gUnmanagedSurface* surface, int width, int height, int flag, size_t keep, std::shared_ptr<gSurface> &src);
+    const int *scaleColumns(int src_width, int width, int from, int count);
+
+    std::shared_ptr<gUnmanagedSurface> m_surface;
+    std::shared_ptr<gUnmanagedSurface> m_view; /* blitFrom() source */
+    ImageCache *m_cache;
+    FrameArena m_arena; /* temporaries of the current render */
+    eRect m_dirty;
+    std::vector<int> m_columns; /* scaleColumns() of the last scaled blit */
+    int m_columnsSrc, m_columnsDst, m_columnsStart;
 };
 
 #endif
@@ -16,276 +16,607 @@
 */
 
 #include <unistd.h>
-#include <fcntl.h>
 #include <stdio.h>
-#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <cstring>
 
 #include "vfd.h"
+#include "rgb565.h"
 
-const char *OLED_PROC_1 = "/proc/stb/lcd/oled_brightness";
-const char *OLED_PROC_2 = "/proc/stb/fp/oled_brightness";
+/* FNV-1a over 64 bit words, only used to tell identical frames apart */
+static uint64_t hashData(const unsigned char *data, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (len >= 8)
+    {
+        uint64_t w;
+        memcpy(&w, data, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        data += 8;
+        len -= 8;
+    }
+    while (len--)
+        h = (h ^ *data++) * 0x100000001b3ULL;
+    return h;
+}
 
+bool VFD::SourceKey::operator==(const SourceKey &o) const
+{
+    return path == o.path && mtime.tv_sec == o.mtime.tv_sec && mtime.tv_nsec == o.mtime.tv_nsec
+        && size == o.size && x == o.x && y == o.y;
+}
 
-VFD::VFD()
+VFD::VFD(VFDBackend *backend)
 {
-    int xres = 400, yres = 240, bpp = 32;
     flipped = false;
     inverted = 0;
-    lcd_type = 0;
-
-    lcdfd = -1;
-
-    if (access(OLED_PROC_1, W_OK) == 0)
-        m_oled_brightness_proc = 1;
-    else if (access(OLED_PROC_2, W_OK) == 0)
-        m_oled_brightness_proc = 2;
-    else
-        m_oled_brightness_proc = 0;
-
-//    printf("[VFD] m_oled_brightness_proc = %d\n", m_oled_brightness_proc);
-    
-    lcdfd = open("/dev/dbox/oled0", O_RDWR);
-
-    if (lcdfd < 0)
-    {
-        if (m_oled_brightness_proc != 0)
-            lcd_type = 2;
-        lcdfd = open("/dev/dbox/lcd0", O_RDWR);
-    }
-    else
-    {
-        printf("[VFD] found OLED display!\n");
-        lcd_type = 1;
-    }
 
-    if (lcdfd < 0) {
-        printf("[VFD] No oled0 or lcd0 device found!\n");
-    }
-    else
-    {
+    m_backend = backend ? backend : new VFDDevice();
 
-#ifndef LCD_IOCTL_ASC_MODE
-#define LCDSET 0x1000
-#define LCD_IOCTL_ASC_MODE (21 | LCDSET)
-#define LCD_MODE_ASC 0
-#define LCD_MODE_BIN 1
-#endif
+    VFDGeometry geo;
+    m_open = m_backend->open(geo);
+    lcd_type = geo.lcd_type;
+    int xres = geo.xres, yres = geo.yres, bpp = geo.bpp;
+//    printf("[VFD] xres=%d, yres=%d, bpp=%d lcd_type=%d\n", xres, yres, bpp, lcd_type);
 
-        int i = LCD_MODE_BIN;
-        ioctl(lcdfd, LCD_IOCTL_ASC_MODE, &i);
-        FILE *f = fopen("/proc/stb/lcd/xres", "r");
-        if (f)
-        {
-            int tmp;
-            if (fscanf(f, "%x", &tmp) == 1)
-                xres = tmp;
-            fclose(f);
-            f = fopen("/proc/stb/lcd/yres", "r");
-            if (f)
-            {
-                if (fscanf(f, "%x", &tmp) == 1)
-                    yres = tmp;
-                fclose(f);
-                f = fopen("/proc/stb/lcd/bpp", "r");
-                if (f)
-                {
-                    if (fscanf(f, "%x", &tmp) == 1)
-                        bpp = tmp;
-                    fclose(f);
-                }
-            }
-            lcd_type = 3;
-        }
-//        printf("[VFD] xres=%d, yres=%d, bpp=%d lcd_type=%d\n", xres, yres, bpp, lcd_type);
-    }
-    
     _stride = xres * bpp / 8;
-    _buffer = new unsigned char[xres * yres * bpp / 8];
+    /* lcd_type 0..2 are always read as 132x64 bytes by Write() */
+    m_size = xres * yres * bpp / 8;
+    if (m_size < 132 * 64)
+        m_size = 132 * 64;
+    _buffer = new unsigned char[m_size];
 #ifdef LCD_DM900_Y_OFFSET
     xres -= LCD_DM900_Y_OFFSET;
 #endif
     res = eSize(xres, yres);
-    memset(_buffer, 0, xres * yres * bpp / 8);
+    memset(_buffer, 0, m_size);
 //    printf("[VFD] (%dx%dx%d) buffer %p %d bytes, stride %d\n", xres, yres, bpp, _buffer, xres * yres * bpp / 8, _stride);
 
     m_bpp = bpp;
+
+    _raw = NULL;
+    m_cache = NULL;
+    m_blitFlags = uPNG::blitAlphaBlend;
+    m_full = true;
+    m_partial = false;
+    m_rowhash = NULL;
+    m_newhash = NULL;
+    m_framehash = 0;
+    m_writeFailed = false;
+    m_frames = 0;
+    m_skipped = 0;
+    m_wake = false;
+
+    _pending = NULL;
+    _front = NULL;
+    m_async = false;
+    m_stop = false;
+    m_busy = false;
+    m_queuedFull = false;
+    m_queuedWake = false;
+    m_merged = 0;
+    m_interval = std::chrono::microseconds(0);
+    m_brightness = 102;
+    m_appliedBrightness = -1;
 }
 
 
 VFD::~VFD()
 {
-    if (lcdfd >= 0)
-    {
-        close(lcdfd);
-        lcdfd = -1;
-    }
+    setAsync(false);
+    if (_pending)
+        delete[] _pending;
+    if (_front)
+        delete[] _front;
     if (_buffer)
         delete[] _buffer;
+    if (_raw)
+        delete[] _raw;
+    if (m_rowhash)
+        delete[] m_rowhash;
+    if (m_newhash)
+        delete[] m_newhash;
+    delete[] surface.clut.data;
+    delete m_backend;
 }
 
-void VFD::Write()
+bool VFD::Write()
 {
-#if !defined(HAVE_TEXTLCD) && !defined(HAVE_7SEGMENT)
-    if (lcdfd >= 0)
+    if (!m_open)
+        return false;
+
+    eRect dirty = m_full ? eRect(ePoint(0, 0), res) : (m_dirty & eRect(ePoint(0, 0), res));
+    bool init = m_full;
+    bool brightness = m_wake;
+    m_dirty = eRect();
+    m_full = false;
+    m_wake = false;
+    if (dirty.empty())
+        return false;
+
+    if (m_async)
     {
-        size_t bs = 0;
-        size_t bw = 0;
-        
-        if (lcd_type == 0 || lcd_type == 2)
+        queueFrame(dirty, init, brightness);
+        return true;
+    }
+    return writeFrame(_buffer, dirty, init, brightness);
+}
+
+/* convert the dirty area of fb to the panel layout, span is the converted area in panel memory */
+const unsigned char *VFD::convertFrame(const unsigned char *fb, const eRect &dirty, eRect &span, size_t &len)
+{
+    if (!_raw)
+        _raw = new unsigned char[m_size];
+    span = dirty;
+
+    if (lcd_type == 0 || lcd_type == 2)
+    {
+        unsigned char *raw = _raw;
+        int x, y, yy;
+        for (y = 0; y < 8; y++)
         {
-            unsigned char raw[132 * 8];
-            int x, y, yy;
-            for (y = 0; y < 8; y++)
+            for (x = 0; x < 132; x++)
             {
-                for (x = 0; x < 132; x++)
+                int pix = 0;
+                for (yy = 0; yy < 8; yy++)
+                {
+                    pix |= (fb[(y * 8 + yy) * 132 + x] >= 108) << yy;
+                }
+                if (flipped)
+                {
+                    /* 8 pixels per byte, swap bits */
+#define BIT_SWAP(a) ((((a << 7) & 0x80) + ((a << 5) & 0x40) + ((a << 3) & 0x20) + ((a << 1) & 0x10) + ((a >> 1) & 0x08) + ((a >> 3) & 0x04) + ((a >> 5) & 0x02) + ((a >> 7) & 0x01)) & 0xff)
+                    raw[(7 - y) * 132 + (131 - x)] = BIT_SWAP(pix ^ inverted);
+                }
+                else
+                {
+                    raw[y * 132 + x] = pix ^ inverted;
+                }
+            }
+        }
+        len = 132 * 8;
+        return raw;
+    }
+    else if (lcd_type == 3)
+    {
+        len = _stride * res.height();
+        const unsigned char *out = fb;
+        /* for now, only support flipping / inverting for 8bpp displays */
+        if ((flipped || inverted) && _stride == res.width())
+        {
+            unsigned int height = res.height();
+            unsigned int width = res.width();
+            for (int y = dirty.top(); y < dirty.bottom(); y++)
+            {
+                for (int x = dirty.left(); x < dirty.right(); x++)
                 {
-                    int pix = 0;
-                    for (yy = 0; yy < 8; yy++)
-                    {
-                        pix |= (_buffer[(y * 8 + yy) * 132 + x] >= 108) << yy;
-                    }
                     if (flipped)
                     {
-                        /* 8 pixels per byte, swap bits */
-#define BIT_SWAP(a) ((((a << 7) & 0x80) + ((a << 5) & 0x40) + ((a << 3) & 0x20) + ((a << 1) & 0x10) + ((a >> 1) & 0x08) + ((a >> 3) & 0x04) + ((a >> 5) & 0x02) + ((a >> 7) & 0x01)) & 0xff)
-                        raw[(7 - y) * 132 + (131 - x)] = BIT_SWAP(pix ^ inverted);
+                        /* 8bpp, no bit swapping */
+                        _raw[(height - 1 - y) * width + (width - 1 - x)] = fb[y * width + x] ^ inverted;
                     }
                     else
                     {
-                        raw[y * 132 + x] = pix ^ inverted;
+                        _raw[y * width + x] = fb[y * width + x] ^ inverted;
                     }
                 }
             }
-            bs = 132 * 8;
-            bw = write(lcdfd, raw, bs);
+            if (flipped)
+                span = eRect(width - dirty.right(), height - dirty.bottom(), dirty.width(), dirty.height());
+            out = _raw;
         }
-        else if (lcd_type == 3)
+        else
         {
-            bs = _stride * res.height();
-            /* for now, only support flipping / inverting for 8bpp displays */
-            if ((flipped || inverted) && _stride == res.width())
+#if defined(LCD_DM900_Y_OFFSET)
+            /* the panel memory is shifted by whole words, convert complete rows */
+            int words = _stride >> 2;
+            for (int offset = dirty.top() * words; offset < dirty.bottom() * words; offset++)
             {
-                unsigned int height = res.height();
-                unsigned int width = res.width();
-                unsigned char raw[_stride * height];
-                for (unsigned int y = 0; y < height; y++)
-                {
-                    for (unsigned int x = 0; x < width; x++)
-                    {
-                        if (flipped)
-                        {
-                            /* 8bpp, no bit swapping */
-                            raw[(height - 1 - y) * width + (width - 1 - x)] = _buffer[y * width + x] ^ inverted;
-                        }
-                        else
-                        {
-                            raw[y * width + x] = _buffer[y * width + x] ^ inverted;
-                        }
-                    }
-                }
-                bw = write(lcdfd, raw, bs);
+                unsigned int src = 0;
+                if (offset % words >= LCD_DM900_Y_OFFSET)
+                    src = ((const unsigned int *)fb)[offset - LCD_DM900_Y_OFFSET];
+                //                                             blue                         red                  green low                     green high
+                ((unsigned int *)_raw)[offset] = ((src >> 3) & 0x001F001F) | ((src << 3) & 0xF800F800) | ((src >> 8) & 0x00E000E0) | ((src << 8) & 0x07000700);
             }
-            else
+            span = eRect(0, dirty.top(), _stride / (m_bpp / 8), dirty.height());
+            out = _raw;
+#elif defined(LCD_COLOR_BITORDER_RGB565)
+            // gggrrrrrbbbbbggg bit order from memory
+            // gggbbbbbrrrrrggg bit order to LCD
+            for (int y = dirty.top(); y < dirty.bottom(); y++)
             {
-#if defined(LCD_DM900_Y_OFFSET)
-                unsigned char gb_buffer[_stride * res.height()];
-                for (int offset = 0; offset < ((_stride * res.height()) >> 2); offset++)
+                const uint16_t *src = (const uint16_t *)(fb + y * _stride) + dirty.left();
+                uint16_t *dst = (uint16_t *)(_raw + y * _stride) + dirty.left();
+                swap_565_bitorder(dst, src, dirty.width());
+            }
+            out = _raw;
+#endif
+        }
+        return out;
+    }
+    else /* lcd_type == 1 */
+    {
+        unsigned char *raw = _raw;
+        int x, y;
+        memset(raw, 0, 64 * 64);
+        for (y = 0; y < 64; y++)
+        {
+            int pix = 0;
+            for (x = 0; x < 128 / 2; x++)
+            {
+                pix = (fb[y * 132 + x * 2 + 2] & 0xF0) | (fb[y * 132 + x * 2 + 1 + 2] >> 4);
+                if (inverted)
+                    pix = 0xFF - pix;
+                if (flipped)
                 {
-                    unsigned int src = 0;
-                    if (offset % (_stride >> 2) >= LCD_DM900_Y_OFFSET)
-                        src = ((unsigned int *)_buffer)[offset - LCD_DM900_Y_OFFSET];
-                    //                                             blue                         red                  green low                     green high
-                    ((unsigned int *)gb_buffer)[offset] = ((src >> 3) & 0x001F001F) | ((src << 3) & 0xF800F800) | ((src >> 8) & 0x00E000E0) | ((src << 8) & 0x07000700);
-                }
-                bw = write(lcdfd, gb_buffer, bs);
-#elif defined(LCD_COLOR_BITORDER_RGB565)
-                // gggrrrrrbbbbbggg bit order from memory
-                // gggbbbbbrrrrrggg bit order to LCD
-                unsigned char gb_buffer[_stride * res.height()];
-                if (!(0x03 & (_stride * res.height())))
-                { // fast
-                    for (int offset = 0; offset < ((_stride * res.height()) >> 2); offset++)
-                    {
-                        unsigned int src = ((unsigned int *)_buffer)[offset];
-                        ((unsigned int *)gb_buffer)[offset] = src & 0xE007E007 | (src & 0x1F001F00) >> 5 | (src & 0x00F800F8) << 5;
-                    }
+                    /* device seems to be 4bpp, swap nibbles */
+                    unsigned char byte;
+                    byte = (pix >> 4) & 0x0f;
+                    byte |= (pix << 4) & 0xf0;
+                    raw[(63 - y) * 64 + (63 - x)] = byte;
                 }
                 else
-                { // slow
-                    for (int offset = 0; offset < _stride * res.height(); offset += 2)
-                    {
-                        gb_buffer[offset] = (_buffer[offset] & 0x07) | ((_buffer[offset + 1] << 3) & 0xE8);
-                        gb_buffer[offset + 1] = (_buffer[offset + 1] & 0xE0) | ((_buffer[offset] >> 3) & 0x1F);
-                    }
+                {
+                    raw[y * 64 + x] = pix;
                 }
-                bw = write(lcdfd, gb_buffer, bs);
-#else
-                bw = write(lcdfd, _buffer, bs);
-#endif
             }
         }
-        else /* lcd_type == 1 */
+        len = 64 * 64;
+        return raw;
+    }
+}
+
+/* convert the dirty area of fb and send it to the panel */
+bool VFD::writeFrame(const unsigned char *fb, const eRect &dirty, bool init, bool brightness)
+{
+#if !defined(HAVE_TEXTLCD) && !defined(HAVE_7SEGMENT)
+    size_t bs = 0;
+    bool written;
+    if (m_writeFailed)
+        init = true;
+    bool full = init || !m_partial || !m_backend->canPwrite();
+    eRect span; /* dirty area in panel memory */
+    const unsigned char *out = convertFrame(fb, dirty, span, bs);
+
+    if (lcd_type == 3)
+    {
+        /* drop the rows that came out the same as on the panel */
+        if (!m_rowhash)
+        {
+            m_rowhash = new uint64_t[res.height()];
+            m_newhash = new uint64_t[res.height()];
+        }
+        int first = -1, last = -1;
+        for (int y = span.top(); y < span.bottom(); y++)
         {
-            unsigned char raw[64 * 64];
-            int x, y;
-            memset(raw, 0, 64 * 64);
-            for (y = 0; y < 64; y++)
+            m_newhash[y] = hashData(out + y * _stride, _stride);
+            if (init || m_newhash[y] != m_rowhash[y])
             {
-                int pix = 0;
-                for (x = 0; x < 128 / 2; x++)
-                {
-                    pix = (_buffer[y * 132 + x * 2 + 2] & 0xF0) | (_buffer[y * 132 + x * 2 + 1 + 2] >> 4);
-                    if (inverted)
-                        pix = 0xFF - pix;
-                    if (flipped)
-                    {
-                        /* device seems to be 4bpp, swap nibbles */
-                        unsigned char byte;
-                        byte = (pix >> 4) & 0x0f;
-                        byte |= (pix << 4) & 0xf0;
-                        raw[(63 - y) * 64 + (63 - x)] = byte;
-                    }
-                    else
-                    {
-                        raw[y * 64 + x] = pix;
-                    }
-                }
+                if (first < 0)
+                    first = y;
+                last = y;
             }
-            bs = 64 * 64;
-            bw = write(lcdfd, raw, bs);
         }
-//        printf("[VFD] %ld bytes writen %ld\n", bw, bs);
+        if (first < 0)
+        {
+            m_skipped++;
+            return false;
+        }
+        span = eRect(span.left(), first, span.width(), last + 1 - first);
 
+        if (full)
+            written = m_backend->write(out, bs) == (ssize_t)bs;
+        else
+            written = writeSpans(out, span);
+        /* the rows count as on the panel once they were written */
+        if (written)
+            memcpy(m_rowhash + first, m_newhash + first, (last + 1 - first) * sizeof(uint64_t));
     }
+    else
+    {
+        uint64_t h;
+        if (!frameChanged(out, bs, init, h))
+            return false;
+        written = m_backend->write(out, bs) == (ssize_t)bs;
+        if (written)
+            m_framehash = h;
+    }
+
+    if (!written)
+    {
+        if (!m_writeFailed)
+            printf("[VFD] write frame failed (%m)\n");
+        m_writeFailed = true;
+        return false;
+    }
+    m_writeFailed = false;
+    m_frames++;
+    if (brightness)
+        applyBrightness(m_brightness);
+    return true;
 #endif
+    return false;
 }
 
-int VFD::setLCDBrightness(int brightness)
+bool VFD::frameChanged(const unsigned char *raw, size_t len, bool init, uint64_t &hash)
+{
+    hash = hashData(raw, len);
+    if (!init && hash == m_framehash)
+    {
+        m_skipped++;
+        return false;
+    }
+    return true;
+}
+
+/* true if every byte of the span reached the panel */
+bool VFD::writeSpans(const unsigned char *out, const eRect &span)
+{
+    int bypp = m_bpp / 8;
+    size_t linesize = span.width() * bypp;
+
+    /* wide spans are cheaper as one write of the complete rows */
+    if (linesize * 2 >= (size_t)_stride)
+    {
+        size_t len = _stride * span.height();
+        return m_backend->pwrite(out + span.top() * _stride, len, span.top() * _stride) == (ssize_t)len;
+    }
+
+    for (int y = span.top(); y < span.bottom(); y++)
+    {
+        off_t offset = y * _stride + span.left() * bypp;
+        if (m_backend->pwrite(out + offset, linesize, offset) != (ssize_t)linesize)
+            return false;
+    }
+    return true;
+}
+
+void VFD::queueFrame(const eRect &dirty, bool init, bool brightness)
 {
-    if (lcdfd < 0)
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_queued.empty() || m_queuedFull)
+        m_merged++;
+    copyArea(_pending, _buffer, init ? eRect(ePoint(0, 0), res) : dirty);
+    m_queued |= dirty;
+    m_queuedFull |= init;
+    m_queuedWake |= brightness;
+    m_cond.notify_one();
+}
+
+void VFD::copyArea(unsigned char *dst, const unsigned char *src, const eRect &area)
+{
+    /* the small panels are not read along res, take all of it */
+    if (lcd_type != 3)
+    {
+        memcpy(dst, src, m_size);
+        return;
+    }
+    int bypp = m_bpp / 8;
+    int offset = area.top() * _stride + area.left() * bypp;
+    int linesize = area.width() * bypp;
+#if defined(LCD_DM900_Y_OFFSET)
+    /* writeFrame() reads whole rows */
+    offset = area.top() * _stride;
+    linesize = _stride;
+#endif
+    for (int y = area.height(); y != 0; --y)
+    {
+        memcpy(dst + offset, src + offset, linesize);
+        offset += _stride;
+    }
+}
+
+void VFD::writerThread()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (true)
+    {
+        while (!m_stop && m_queued.empty() && !m_queuedFull)
+            m_cond.wait(lock);
+        if (m_queued.empty() && !m_queuedFull)
+            break;
+
+        /* hold the frame back until the interval is over, later frames merge into it */
+        if (m_interval.count())
+            m_cond.wait_until(lock, m_next, [this] { return m_stop; });
+
+        /* only the latest state is written, however many frames were queued */
+        eRect dirty = m_queued;
+        bool init = m_queuedFull;
+        bool brightness = m_queuedWake;
+        m_queued = eRect();
+        m_queuedFull = false;
+        m_queuedWake = false;
+        copyArea(_front, _pending, init ? eRect(ePoint(0, 0), res) : dirty);
+        m_busy = true;
+
+        lock.unlock();
+        if (writeFrame(_front, dirty, init, brightness))
+            m_next = std::chrono::steady_clock::now() + m_interval;
+        lock.lock();
+
+        m_busy = false;
+        m_cond.notify_all();
+    }
+}
+
+void VFD::setAsync(bool enable)
+{
+    if (enable == m_async)
+        return;
+    if (enable)
+    {
+        if (!_pending)
+        {
+            _pending = new unsigned char[m_size];
+            _front = new unsigned char[m_size];
+        }
+        /* the writer only copies dirty areas, both start as what was drawn so far */
+        memcpy(_pending, _buffer, m_size);
+        memcpy(_front, _buffer, m_size);
+        m_stop = false;
+        m_async = true;
+        m_writer = std::thread(&VFD::writerThread, this);
+    }
+    else
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stop = true;
+            m_cond.notify_all();
+        }
+        /* the writer drains the queue before it exits */
+        m_writer.join();
+        m_async = false;
+    }
+}
+
+void VFD::setMaxRate(int fps)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_interval = std::chrono::microseconds(fps > 0 ? 1000000 / fps : 0);
+    }
+    /* the governor lives in the writer thread */
+    if (fps > 0)
+        setAsync(true);
+}
+
+void VFD::flush()
+{
+    if (!m_async)
+        return;
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (m_busy || !m_queued.empty() || m_queuedFull)
+        m_cond.wait(lock);
+}
+
+void VFD::invalidate(const eRect &area)
+{
+    m_dirty |= area;
+    m_shown.path.clear();
+}
+
+void VFD::invalidate()
+{
+    m_full = true;
+    m_shown.path.clear();
+}
+
+void VFD::clear()
+{
+    /* only the area drawn since the last clear can be non-black */
+    eRect area = m_drawn & eRect(ePoint(0, 0), res);
+    if (!area.empty())
+    {
+        int bypp = _stride / res.width();
+        for (int y = area.top(); y < area.bottom(); y++)
+            memset(_buffer + y * _stride + area.left() * bypp, 0, area.width() * bypp);
+        m_dirty |= area;
+    }
+    m_drawn = eRect();
+    m_shown.path.clear();
+}
+
+int VFD::drawImage(const gUnmanagedSurface *img, int posX, int posY)
+{
+    prepareSurface();
+    if (posX >= res.width() || posY >= res.height())
+        return 0; /* off the panel */
+    int ret = rendered(m_png.blitFrom(img, &surface, eRect(posX, posY, res.width() - posX, res.height() - posY), m_blitFlags));
+    if (ret == 0)
+        m_wake = true;
+    return ret;
+}
+
+int VFD::drawSurface(const gUnmanagedSurface *src, const eRect &area, int posX, int posY)
+{
+    eRect dst = area;
+    dst.moveBy(posX, posY);
+    dst &= eRect(ePoint(0, 0), res);
+    if (dst.empty())
         return 0;
 
-    FILE *f = NULL;
-    if (m_oled_brightness_proc == 1)
-        f = fopen(OLED_PROC_1, "w");
-    else if (m_oled_brightness_proc == 2)
-        f = fopen(OLED_PROC_2, "w");
+    int bypp = _stride / res.width();
+    for (int y = dst.top(); y < dst.bottom(); y++)
+        memset(_buffer + y * _stride + dst.left() * bypp, 0, dst.width() * bypp);
+
+    gUnmanagedSurface view = *src;
+    view.data = (uint8_t *)src->data + (dst.top() - posY) * src->stride + (dst.left() - posX) * src->bypp;
+    view.x = dst.width();
+    view.y = dst.height();
+    prepareSurface();
+    int ret = m_png.blitFrom(&view, &surface, dst, uPNG::blitAlphaBlend);
 
-    if (f)
+    m_dirty |= dst;
+    m_drawn |= dst;
+    m_shown.path.clear();
+    m_wake = true;
+    Write();
+    return ret;
+}
+
+gSurface *VFD::createSurface()
+{
+    gSurface *s = new gSurface(res.width(), res.height(), m_bpp);
+    memset(s->data, 0, s->y * s->stride);
+    if (lcd_type == 4)
     {
-        if (fprintf(f, "%d", brightness) == 0)
-            printf("[VFD] write oled_brightness failed!! (%m)\n");
-        fclose(f);
+        s->clut.colors = 256;
+        s->clut.data = new gRGB[s->clut.colors];
+        memset(static_cast<void*>(s->clut.data), 0, sizeof(*s->clut.data)*s->clut.colors);
     }
+    return s;
+}
+
+int VFD::displaySurface(const gUnmanagedSurface *src)
+{
+    if (!src || src->bpp != m_bpp)
+        return -1;
+
+    int rows = src->y < res.height() ? src->y : res.height();
+    int len = src->stride < _stride ? src->stride : _stride;
+    for (int y = 0; y < rows; y++)
+        memcpy(_buffer + y * _stride, (const unsigned char *)src->data + y * src->stride, len);
+
+    /* the row hashes keep unchanged rows off the panel */
+    m_drawn = m_dirty = eRect(ePoint(0, 0), res);
+    m_shown.path.clear();
+    m_wake = true;
+    Write();
     return 0;
 }
 
-int VFD::displayPNG(const char* filepath, int posX, int posY)
+void VFD::setScaleToFit(bool enable, int filter)
 {
-    unsigned int height = res.height();
-    unsigned int width = res.width();
+    m_blitFlags = uPNG::blitAlphaBlend;
+    if (enable)
+        m_blitFlags |= uPNG::blitScale | uPNG::blitKeepAspectRatio | uPNG::blitHAlignCenter | uPNG::blitVAlignCenter | filter;
+}
 
+int VFD::setLCDBrightness(int brightness)
+{
+    m_brightness = brightness;
+    return applyBrightness(brightness);
+}
+
+/* called from the writer thread as well */
+int VFD::applyBrightness(int brightness)
+{
+    if (!m_open)
+        return 0;
+
+    std::lock_guard<std::mutex> lock(m_brightnessLock);
+    if (brightness == m_appliedBrightness)
+        return 0;
+    m_appliedBrightness = brightness;
+    return m_backend->setBrightness(brightness);
+}
+
+void VFD::prepareSurface()
+{
     surface.x = size().width();
     surface.y = size().height();
     surface.stride = _stride;
@@ -295,6 +626,9 @@ int VFD::displayPNG(const char* filepath, int posX, int posY)
     surface.data_phys = 0;
     if (lcd_type == 4)
     {
+        /* prepared for every frame, the all black palette is made once */
+        if (surface.clut.data)
+            return;
         surface.clut.colors = 256;
         surface.clut.data = new gRGB[surface.clut.colors];
         memset(static_cast<void*>(surface.clut.data), 0, sizeof(*surface.clut.data)*surface.clut.colors);
@@ -304,15 +638,203 @@ int VFD::displayPNG(const char* filepath, int posX, int posY)
         surface.clut.colors = 0;
         surface.clut.data = 0;
     }
+}
 
-    int res;
-	res = m_png.render( filepath, posX, posY, &surface, width, height, m_bpp, 2);
+/* book keeping after m_png drew into the frame buffer */
+int VFD::rendered(int res)
+{
+    m_shown.path.clear();
+    /* a broken stream can leave a partial image, clear() has to remove it */
+    m_drawn |= m_png.dirtyRect();
+    if(res == 0)
+        m_dirty |= m_png.dirtyRect();
+    return res;
+}
+
+int VFD::renderPNG(const char* filepath, int posX, int posY)
+{
+    prepareSurface();
+	return rendered(m_png.render( filepath, posX, posY, &surface, res.width() - posX, res.height() - posY, m_bpp, m_blitFlags));
+}
+
+int VFD::displayPNG(const char* filepath, int posX, int posY)
+{
+    int res = renderPNG(filepath, posX, posY);
+    if (res == 0)
+    {
+        m_wake = true;
+        Write();
+    }
+    return res;
+}
+
+int VFD::displayPNG(const void* data, size_t len, int posX, int posY)
+{
+    prepareSurface();
+    int ret = rendered(m_png.render(data, len, posX, posY, &surface, res.width() - posX, res.height() - posY, m_bpp, m_blitFlags));
+    if (ret == 0)
+    {
+        m_wake = true;
+        Write();
+    }
+    return ret;
+}
 
-    if(res == 0) {
+int VFD::displayPNGFd(int fd, int posX, int posY)
+{
+    prepareSurface();
+    int ret = rendered(m_png.renderFd(fd, posX, posY, &surface, res.width() - posX, res.height() - posY, m_bpp, m_blitFlags));
+    if (ret == 0)
+    {
+        m_wake = true;
         Write();
-        setLCDBrightness(102);
     }
-    
-	return res;
+    return ret;
+}
+
+void VFD::rawHeader(VFDRawHeader &hdr, size_t size)
+{
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, VFD_RAW_MAGIC, sizeof(hdr.magic));
+    hdr.lcd_type = lcd_type;
+    hdr.stride = _stride;
+    hdr.height = res.height();
+    hdr.bpp = m_bpp;
+#if defined(LCD_DM900_Y_OFFSET)
+    hdr.flags |= 1;
+#endif
+#if defined(LCD_COLOR_BITORDER_RGB565)
+    hdr.flags |= 2;
+#endif
+    hdr.flags |= flipped ? 4 : 0;
+    hdr.flags |= inverted ? 8 : 0;
+    hdr.size = size;
+}
+
+int VFD::compile(const char* filepath, int posX, int posY, const char *out)
+{
+    clear();
+    int ret = renderPNG(filepath, posX, posY);
+    if (ret != 0)
+        return ret;
+
+    eRect span;
+    size_t len;
+    const unsigned char *data = convertFrame(_buffer, eRect(ePoint(0, 0), res), span, len);
+    VFDRawHeader hdr;
+    rawHeader(hdr, len);
+
+    FILE *f = fopen(out, "wb");
+    if (!f)
+    {
+        printf("[VFD] couldn't create %s (%m)\n", out);
+        return -1;
+    }
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(data, len, 1, f) == 1;
+    if (fclose(f) != 0 || !ok)
+    {
+        printf("[VFD] couldn't write %s\n", out);
+        unlink(out);
+        return -1;
+    }
+    /* the frame was only rendered for the file, it is not on the panel */
+    m_dirty = eRect();
+    return 0;
+}
+
+bool VFD::isRaw(const char* filepath)
+{
+    char magic[8];
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool raw = read(fd, magic, sizeof(magic)) == sizeof(magic) && !memcmp(magic, VFD_RAW_MAGIC, sizeof(magic));
+    close(fd);
+    return raw;
+}
+
+int VFD::displayRaw(const char* filepath)
+{
+    if (!m_open)
+        return -1;
+
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        printf("[VFD] couldn't open %s\n", filepath);
+        return -1;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(VFDRawHeader))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        printf("[VFD] couldn't map %s\n", filepath);
+        return -1;
+    }
+
+    const VFDRawHeader *hdr = (const VFDRawHeader *)map;
+    const unsigned char *data = (const unsigned char *)map + sizeof(VFDRawHeader);
+    VFDRawHeader want;
+    rawHeader(want, hdr->size);
+    if (memcmp(hdr, &want, sizeof(want)) || hdr->size > st.st_size - sizeof(VFDRawHeader) || hdr->size > (size_t)m_size)
+    {
+        printf("[VFD] %s was compiled for a different panel\n", filepath);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    /* the writer thread must not interleave an older frame */
+    flush();
+    std::unique_lock<std::mutex> lock(m_lock);
+    bool written = m_backend->write(data, hdr->size) == (ssize_t)hdr->size;
+    lock.unlock();
+    munmap(map, st.st_size);
+
+    /* the panel no longer shows the frame buffer, the next frame is written in full */
+    m_full = true;
+    m_shown.path.clear();
+    if (!written)
+    {
+        printf("[VFD] write %s failed (%m)\n", filepath);
+        return -1;
+    }
+    m_frames++;
+    applyBrightness(m_brightness);
+    return 0;
+}
+
+int VFD::showPNG(const char* filepath, int posX, int posY)
+{
+    SourceKey key;
+    struct stat st;
+
+    if (stat(filepath, &st) == 0)
+    {
+        key.path = filepath;
+        key.mtime = st.st_mtim;
+        key.size = st.st_size;
+        key.x = posX;
+        key.y = posY;
+        if (key == m_shown)
+        {
+            m_skipped++;
+            return 0;
+        }
+    }
+
+    int res;
+    if (isRaw(filepath))
+        res = displayRaw(filepath);
+    else
+    {
+        clear();
+        res = displayPNG(filepath, posX, posY);
+    }
+    if (res == 0)
+        m_shown = key;
+    return res;
 }
 
@@ -19,24 +19,104 @@
 #define _VFD_H_
 
 #include <string>
+#include <time.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 //#include "ft.h"
 #include "upng.h"
 #include "esize.h"
+#include "vfdbackend.h"
+#include "imagecache.h"
+
+#define VFD_RAW_MAGIC "VFDRAW1"
+
+/* header of a compiled image, followed by the panel memory as written to the device */
+struct VFDRawHeader
+{
+    char magic[8];
+    uint32_t lcd_type;
+    uint32_t stride, height, bpp;
+    uint32_t flags; /* layout options built into the binary */
+    uint32_t size;
+};
 
 class VFD
 {
 private:
-    int lcdfd;
+    VFDBackend *m_backend;
+    bool m_open;
     unsigned char *_buffer;
+    unsigned char *_raw; /* converted panel memory, if the panel needs conversion */
     int _stride;
+    int m_size;
     eSize res;
     unsigned char inverted;
     bool flipped;
 	int m_bpp;
 	uPNG m_png;
+    ImageCache *m_cache;
+    int m_blitFlags; /* uPNG::blit flags for images */
     int lcd_type;
-    int m_oled_brightness_proc;
     gUnmanagedSurface surface;
+    eRect m_dirty; /* changed since the last Write() */
+    eRect m_drawn; /* drawn since the last clear() */
+    bool m_full;
+    bool m_partial;
+    uint64_t *m_rowhash; /* per row hash of the panel memory, lcd_type 3 */
+    uint64_t *m_newhash; /* row hashes of the frame being written */
+    uint64_t m_framehash;
+    bool m_writeFailed; /* the panel may not show the last frame, the next one is written in full */
+    std::atomic<unsigned int> m_frames;
+    std::atomic<unsigned int> m_skipped;
+    bool m_wake; /* apply the brightness with the next written frame */
+
+    /* asynchronous writer, renders go to _buffer, the writer works on _front */
+    std::thread m_writer;
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    unsigned char *_pending; /* latest frame handed over to the writer */
+    unsigned char *_front;
+    eRect m_queued;
+    bool m_queuedFull;
+    bool m_queuedWake;
+    bool m_async;
+    bool m_stop;
+    bool m_busy;
+    std::atomic<unsigned int> m_merged;
+    std::chrono::microseconds m_interval; /* minimum time between two writes */
+    std::chrono::steady_clock::time_point m_next;
+    std::atomic<int> m_brightness;
+    int m_appliedBrightness; /* last value written to the panel */
+    std::mutex m_brightnessLock;
+
+    /* identifies the image currently on the panel */
+    struct SourceKey
+    {
+        std::string path;
+        struct timespec mtime;
+        off_t size;
+        int x, y;
+
+        bool operator==(const SourceKey &o) const;
+    };
+    SourceKey m_shown;
+
+    const unsigned char *convertFrame(const unsigned char *fb, const eRect &dirty, eRect &span, size_t &len);
+    void rawHeader(VFDRawHeader &hdr, size_t size);
+    void prepareSurface();
+    int rendered(int res);
+    int renderPNG(const char* filepath, int posX, int posY);
+    bool writeSpans(const unsigned char *out, const eRect &span);
+    bool frameChanged(const unsigned char *raw, size_t len, bool init, uint64_t &hash);
+    bool writeFrame(const unsigned char *fb, const eRect &dirty, bool init, bool brightness);
+    void queueFrame(const eRect &dirty, bool init, bool brightness);
+    void copyArea(unsigned char *dst, const unsigned char *src, const eRect &area);
+    void writerThread();
+    int applyBrightness(int brightness);
 
 public:
 
@@ -46,11 +126,58 @@ public:
 
     eSize size() { return res; };
 
-    VFD();
+    /* takes ownership of backend, NULL opens the default device */
+    VFD(VFDBackend *backend = NULL);
 	~VFD();
-	void Write(void);
+	/* returns false if nothing had to be written */
+	bool Write(void);
+	/* write from a separate thread, Write() only hands the frame over */
+	void setAsync(bool enable);
+	/* wait until the writer thread is idle */
+	void flush();
+	/* limit the panel updates per second, frames in between are merged */
+	void setMaxRate(int fps);
+	void clear();
+	/* mark an area of buffer() as changed, without area the whole panel */
+	void invalidate(const eRect &area);
+	void invalidate();
+	/* write only the changed area if the driver supports offset writes */
+	void setPartialUpdates(bool enable) { m_partial = enable; }
+	/*
+	 * images are scaled to the panel area right and below of their position,
+	 * filter is uPNG::blitScaleBilinear, uPNG::blitScaleArea or 0 for the nearest pixel
+	 */
+	void setScaleToFit(bool enable, int filter = 0);
+	int blitFlags() const { return m_blitFlags; }
 	int displayPNG(const char* filepath, int posX, int posY);
+	/* draw a png held in memory or read from fd, e.g. stdin or a pipe */
+	int displayPNG(const void* data, size_t len, int posX, int posY);
+	int displayPNGFd(int fd, int posX, int posY);
+	/* replace the panel contents, nothing is done if the same file is shown already */
+	int showPNG(const char* filepath, int posX, int posY);
+	/* draw an image on a black panel and store the result in the panel layout */
+	int compile(const char* filepath, int posX, int posY, const char *out);
+	/* write a compiled image straight to the panel */
+	int displayRaw(const char* filepath);
+	static bool isRaw(const char* filepath);
+	/* draw a decoded image into the frame buffer, Write() puts it on the panel */
+	int drawImage(const gUnmanagedSurface *img, int posX, int posY);
+	/* show area of a 32bpp surface at posX, posY on black, nothing else changes */
+	int drawSurface(const gUnmanagedSurface *src, const eRect &area, int posX, int posY);
+	/* a black surface in the panel format, for drawing off screen */
+	gSurface *createSurface();
+	/* replace the panel contents with a surface from createSurface() */
+	int displaySurface(const gUnmanagedSurface *src);
+    /* share decoded images between renders, not owned */
+    void setImageCache(ImageCache *cache) { m_cache = cache; m_png.setCache(cache); }
+    ImageCache *imageCache() const { return m_cache; }
+    /* set the brightness used from now on, the panel is only written on changes */
     int setLCDBrightness(int brightness);
+
+    unsigned int writtenFrames() const { return m_frames; }
+    unsigned int skippedFrames() const { return m_skipped; }
+    /* frames that were merged into a later one before they were written */
+    unsigned int mergedFrames() const { return m_merged; }
 };
 
 #endif
@@ -0,0 +1,357 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <cstring>
+
+#include "vfdbackend.h"
+
+#ifndef LCD_IOCTL_ASC_MODE
+#define LCDSET 0x1000
+#define LCD_IOCTL_ASC_MODE (21 | LCDSET)
+#define LCD_MODE_ASC 0
+#define LCD_MODE_BIN 1
+#endif
+
+VFDPaths::VFDPaths()
+{
+    oled_dev = "/dev/dbox/oled0";
+    lcd_dev = "/dev/dbox/lcd0";
+    xres = "/proc/stb/lcd/xres";
+    yres = "/proc/stb/lcd/yres";
+    bpp = "/proc/stb/lcd/bpp";
+    brightness1 = "/proc/stb/lcd/oled_brightness";
+    brightness2 = "/proc/stb/fp/oled_brightness";
+    cache = "/run/displayvfd.geometry";
+}
+
+void VFDPaths::setRoot(const std::string &root)
+{
+    oled_dev = root + oled_dev;
+    lcd_dev = root + lcd_dev;
+    xres = root + xres;
+    yres = root + yres;
+    bpp = root + bpp;
+    brightness1 = root + brightness1;
+    brightness2 = root + brightness2;
+    if (!cache.empty())
+        cache = root + cache;
+}
+
+VFDDevice::VFDDevice(const VFDPaths &paths): m_paths(paths)
+{
+    m_fd = -1;
+    m_oled_brightness_proc = 0;
+    m_brightness_fd = -1;
+    m_seekable = false;
+}
+
+VFDDevice::~VFDDevice()
+{
+    if (m_brightness_fd >= 0)
+    {
+        close(m_brightness_fd);
+        m_brightness_fd = -1;
+    }
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+void VFDDevice::initDevice()
+{
+    int i = LCD_MODE_BIN;
+    ioctl(m_fd, LCD_IOCTL_ASC_MODE, &i);
+
+    /*
+     * drivers with noop_llseek stay at 0, no_llseek fails. A driver that
+     * can seek may still write every frame at 0, that can't be told from
+     * here, so -P is only for panels known to honour the offset.
+     */
+    m_seekable = lseek(m_fd, 1, SEEK_SET) == 1;
+    lseek(m_fd, 0, SEEK_SET);
+}
+
+/*
+ * The cache holds the probe result and the identity of the device node.
+ * /run is cleared on boot and a recreated node (driver reload) gets a new
+ * inode, so checking the node is enough to trust the rest.
+ */
+bool VFDDevice::openCached(VFDGeometry &geo)
+{
+    if (m_paths.cache.empty())
+        return false;
+    FILE *f = fopen(m_paths.cache.c_str(), "r");
+    if (!f)
+        return false;
+
+    VFDGeometry cached;
+    int proc, oled;
+    unsigned long ino, rdev;
+    int n = fscanf(f, "%d %d %d %d %d %d %lu %lu", &cached.lcd_type, &cached.xres, &cached.yres, &cached.bpp,
+        &proc, &oled, &ino, &rdev);
+    fclose(f);
+    if (n != 8)
+        return false;
+
+    m_fd = ::open(oled ? m_paths.oled_dev.c_str() : m_paths.lcd_dev.c_str(), O_RDWR);
+    if (m_fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(m_fd, &st) < 0 || st.st_ino != ino || st.st_rdev != rdev)
+    {
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    if (proc)
+    {
+        m_brightness_fd = ::open(proc == 1 ? m_paths.brightness1.c_str() : m_paths.brightness2.c_str(), O_WRONLY | O_CLOEXEC);
+        if (m_brightness_fd < 0)
+        {
+            close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+    }
+    m_oled_brightness_proc = proc;
+    initDevice();
+    geo = cached;
+    return true;
+}
+
+void VFDDevice::saveCache(const VFDGeometry &geo, bool oled)
+{
+    struct stat st;
+    if (m_paths.cache.empty() || fstat(m_fd, &st) < 0)
+        return;
+
+    std::string tmp = m_paths.cache + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f)
+        return;
+    fprintf(f, "%d %d %d %d %d %d %lu %lu\n", geo.lcd_type, geo.xres, geo.yres, geo.bpp,
+        m_oled_brightness_proc, oled ? 1 : 0, (unsigned long)st.st_ino, (unsigned long)st.st_rdev);
+    if (fclose(f) == 0)
+        rename(tmp.c_str(), m_paths.cache.c_str());
+    else
+        unlink(tmp.c_str());
+}
+
+bool VFDDevice::open(VFDGeometry &geo)
+{
+    if (openCached(geo))
+        return true;
+
+    /* kept open, brightness is written whenever it changes */
+    if ((m_brightness_fd = ::open(m_paths.brightness1.c_str(), O_WRONLY | O_CLOEXEC)) >= 0)
+        m_oled_brightness_proc = 1;
+    else if ((m_brightness_fd = ::open(m_paths.brightness2.c_str(), O_WRONLY | O_CLOEXEC)) >= 0)
+        m_oled_brightness_proc = 2;
+    else
+        m_oled_brightness_proc = 0;
+
+//    printf("[VFD] m_oled_brightness_proc = %d\n", m_oled_brightness_proc);
+
+    m_fd = ::open(m_paths.oled_dev.c_str(), O_RDWR);
+    bool oled = m_fd >= 0;
+
+    if (m_fd < 0)
+    {
+        if (m_oled_brightness_proc != 0)
+            geo.lcd_type = 2;
+        m_fd = ::open(m_paths.lcd_dev.c_str(), O_RDWR);
+    }
+    else
+    {
+        printf("[VFD] found OLED display!\n");
+        geo.lcd_type = 1;
+    }
+
+    if (m_fd < 0) {
+        printf("[VFD] No oled0 or lcd0 device found!\n");
+        return false;
+    }
+
+    initDevice();
+
+    FILE *f = fopen(m_paths.xres.c_str(), "r");
+    if (f)
+    {
+        int tmp;
+        if (fscanf(f, "%x", &tmp) == 1)
+            geo.xres = tmp;
+        fclose(f);
+        f = fopen(m_paths.yres.c_str(), "r");
+        if (f)
+        {
+            if (fscanf(f, "%x", &tmp) == 1)
+                geo.yres = tmp;
+            fclose(f);
+            f = fopen(m_paths.bpp.c_str(), "r");
+            if (f)
+            {
+                if (fscanf(f, "%x", &tmp) == 1)
+                    geo.bpp = tmp;
+                fclose(f);
+            }
+        }
+        geo.lcd_type = 3;
+    }
+    saveCache(geo, oled);
+    return true;
+}
+
+ssize_t VFDDevice::write(const void *data, size_t len)
+{
+    /* a seekable device would otherwise append the next frame */
+    if (m_seekable)
+        return ::pwrite(m_fd, data, len, 0);
+    return ::write(m_fd, data, len);
+}
+
+ssize_t VFDDevice::pwrite(const void *data, size_t len, off_t offset)
+{
+    return ::pwrite(m_fd, data, len, offset);
+}
+
+int VFDDevice::setBrightness(int brightness)
+{
+    if (m_brightness_fd < 0)
+        return 0;
+
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "%d", brightness);
+    if (::pwrite(m_brightness_fd, buf, len, 0) <= 0)
+        printf("[VFD] write oled_brightness failed!! (%m)\n");
+    return 0;
+}
+
+VFDFakePanel::VFDFakePanel(const VFDGeometry &geo, const char *log): m_geo(geo)
+{
+    m_logf = NULL;
+    m_bytes = 0;
+    m_brightness = -1;
+    if (log)
+    {
+        m_log = log;
+        m_logf = fopen(log, "w");
+        if (!m_logf)
+            printf("[VFD] couldn't open fake panel log %s (%m)\n", log);
+    }
+}
+
+VFDFakePanel::~VFDFakePanel()
+{
+    printf("[VFD] fake panel %dx%dx%d lcd_type=%d: %zu writes, %zu bytes\n",
+        m_geo.xres, m_geo.yres, m_geo.bpp, m_geo.lcd_type, m_records.size(), m_bytes);
+    if (m_logf)
+    {
+        fclose(m_logf);
+        FILE *f = fopen((m_log + ".raw").c_str(), "wb");
+        if (f)
+        {
+            if (!m_panel.empty())
+                fwrite(&m_panel[0], 1, m_panel.size(), f);
+            fclose(f);
+        }
+    }
+}
+
+VFDFakePanel *VFDFakePanel::create(const char *spec)
+{
+    VFDGeometry geo;
+    char log[256];
+    int n = 0;
+
+    log[0] = 0;
+    if (sscanf(spec, "%dx%dx%d%n", &geo.xres, &geo.yres, &geo.bpp, &n) != 3)
+        return NULL;
+    spec += n;
+    if (*spec == ':')
+    {
+        n = 0;
+        if (sscanf(spec, ":%d%n", &geo.lcd_type, &n) != 1)
+            return NULL;
+        spec += n;
+        if (*spec == ':' && sscanf(spec, ":%255s", log) != 1)
+            return NULL;
+    }
+    else
+        geo.lcd_type = 3;
+
+    if (geo.lcd_type < 0 || geo.lcd_type > 4)
+        return NULL;
+    if (geo.xres <= 0 || geo.yres <= 0 || (geo.bpp != 8 && geo.bpp != 16 && geo.bpp != 32))
+        return NULL;
+    return new VFDFakePanel(geo, log[0] ? log : NULL);
+}
+
+bool VFDFakePanel::open(VFDGeometry &geo)
+{
+    geo = m_geo;
+    return true;
+}
+
+void VFDFakePanel::record(off_t offset, size_t len)
+{
+    Record r;
+    clock_gettime(CLOCK_MONOTONIC, &r.ts);
+    r.offset = offset;
+    r.len = len;
+    m_records.push_back(r);
+    m_bytes += len;
+    if (m_logf)
+        fprintf(m_logf, "%ld.%09ld write %ld %zu\n", (long)r.ts.tv_sec, r.ts.tv_nsec, (long)offset, len);
+}
+
+ssize_t VFDFakePanel::write(const void *data, size_t len)
+{
+    record(0, len);
+    if (m_panel.size() < len)
+        m_panel.resize(len);
+    memcpy(&m_panel[0], data, len);
+    return len;
+}
+
+ssize_t VFDFakePanel::pwrite(const void *data, size_t len, off_t offset)
+{
+    record(offset, len);
+    if (m_panel.size() < offset + len)
+        m_panel.resize(offset + len);
+    memcpy(&m_panel[offset], data, len);
+    return len;
+}
+
+int VFDFakePanel::setBrightness(int brightness)
+{
+    m_brightness = brightness;
+    if (m_logf)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        fprintf(m_logf, "%ld.%09ld brightness %d\n", (long)ts.tv_sec, ts.tv_nsec, brightness);
+    }
+    return 0;
+}
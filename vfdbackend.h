@@ -0,0 +1,132 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _VFDBACKEND_H_
+#define _VFDBACKEND_H_
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+struct VFDGeometry
+{
+    int lcd_type;
+    int xres, yres, bpp;
+
+    VFDGeometry(): lcd_type(0), xres(400), yres(240), bpp(32) {}
+};
+
+/* the output side of VFD, everything that touches the panel goes through here */
+class VFDBackend
+{
+public:
+    virtual ~VFDBackend() {}
+
+    /* probe the panel and fill geo, returns false if there is no panel */
+    virtual bool open(VFDGeometry &geo) = 0;
+    virtual ssize_t write(const void *data, size_t len) = 0;
+    virtual int setBrightness(int brightness) = 0;
+
+    /* partial updates, true if the device can seek, which is taken as honouring the write offset */
+    virtual bool canPwrite() { return false; }
+    virtual ssize_t pwrite(const void *data, size_t len, off_t offset) { return -1; }
+};
+
+struct VFDPaths
+{
+    std::string oled_dev, lcd_dev;
+    std::string xres, yres, bpp;
+    std::string brightness1, brightness2;
+    std::string cache; /* probe result of the last run, empty to always probe */
+
+    VFDPaths();
+    /* prepend root to every path, for testing against a fake /dev and /proc tree */
+    void setRoot(const std::string &root);
+};
+
+class VFDDevice: public VFDBackend
+{
+private:
+    VFDPaths m_paths;
+    int m_fd;
+    int m_oled_brightness_proc;
+    int m_brightness_fd;
+    bool m_seekable;
+
+    void initDevice();
+    bool openCached(VFDGeometry &geo);
+    void saveCache(const VFDGeometry &geo, bool oled);
+
+public:
+    VFDDevice(const VFDPaths &paths = VFDPaths());
+    ~VFDDevice();
+
+    bool open(VFDGeometry &geo);
+    ssize_t write(const void *data, size_t len);
+    int setBrightness(int brightness);
+    bool canPwrite() { return m_seekable; }
+    ssize_t pwrite(const void *data, size_t len, off_t offset);
+};
+
+/*
+ * Panel emulation for benchmarks and tests. Every write is recorded with
+ * its timestamp, the panel memory is kept so the last frame can be checked.
+ * With a log file, one line per write is appended to it and the panel
+ * memory is dumped to <log>.raw on close.
+ */
+class VFDFakePanel: public VFDBackend
+{
+public:
+    struct Record
+    {
+        struct timespec ts;
+        off_t offset;
+        size_t len;
+    };
+
+private:
+    VFDGeometry m_geo;
+    std::string m_log;
+    FILE *m_logf;
+    std::vector<Record> m_records;
+    std::vector<unsigned char> m_panel;
+    size_t m_bytes;
+    int m_brightness;
+
+    void record(off_t offset, size_t len);
+
+public:
+    VFDFakePanel(const VFDGeometry &geo, const char *log = NULL);
+    ~VFDFakePanel();
+
+    /* WxHxBPP[:lcd_type[:logfile]] */
+    static VFDFakePanel *create(const char *spec);
+
+    bool open(VFDGeometry &geo);
+    ssize_t write(const void *data, size_t len);
+    int setBrightness(int brightness);
+    bool canPwrite() { return true; }
+    ssize_t pwrite(const void *data, size_t len, off_t offset);
+
+    const std::vector<Record> &records() const { return m_records; }
+    const std::vector<unsigned char> &panel() const { return m_panel; }
+    int brightness() const { return m_brightness; }
+};
+
+#endif
@@ -0,0 +1,450 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <cstring>
+
+#include "vfdserver.h"
+#include "imagedecoder.h"
+#include "pacing.h"
+
+static int fillAddress(struct sockaddr_un &addr, const char *path)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    return 0;
+}
+
+static int writeAll(int fd, const char *data, size_t len)
+{
+    while (len)
+    {
+        ssize_t w = write(fd, data, len);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+VFDServer::VFDServer(VFD *vfd, const char *path)
+{
+    m_vfd = vfd;
+    m_path = path;
+    m_fd = -1;
+    m_interval = 0;
+    m_last.tv_sec = m_last.tv_nsec = 0;
+    m_hasPending = false;
+    m_pendingX = m_pendingY = 0;
+    m_dropped = 0;
+}
+
+void VFDServer::setMaxRate(int fps)
+{
+    m_interval = fps > 0 ? 1000 / fps : 0;
+    m_vfd->setMaxRate(fps);
+}
+
+/* ms since the last render */
+long VFDServer::sinceLast()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - m_last.tv_sec) * 1000 + (now.tv_nsec - m_last.tv_nsec) / 1000000;
+}
+
+/* ms until the pending image is due, -1 without one */
+int VFDServer::timeout()
+{
+    if (!m_hasPending)
+        return -1;
+    long elapsed = sinceLast();
+    return elapsed >= m_interval ? 0 : m_interval - elapsed;
+}
+
+int VFDServer::render(const char *path, int x, int y)
+{
+    clock_gettime(CLOCK_MONOTONIC, &m_last);
+    return m_vfd->showPNG(path, x, y);
+}
+
+int VFDServer::render(const std::string &data, int x, int y)
+{
+    clock_gettime(CLOCK_MONOTONIC, &m_last);
+    m_vfd->clear();
+    return m_vfd->displayPNG(data.data(), data.size(), x, y);
+}
+
+void VFDServer::renderPending()
+{
+    if (!m_hasPending)
+        return;
+    m_hasPending = false;
+    if (!m_pendingData.empty())
+    {
+        std::string data;
+        data.swap(m_pendingData);
+        if (render(data, m_pendingX, m_pendingY) != 0)
+            printf("[VFDServer] couldn't draw the image data\n");
+    }
+    else if (render(m_pendingPath.c_str(), m_pendingX, m_pendingY) != 0)
+        printf("[VFDServer] couldn't draw %s\n", m_pendingPath.c_str());
+}
+
+/* an image shown now would come too soon after the last one */
+bool VFDServer::rateLimited()
+{
+    return m_interval && (m_hasPending || sinceLast() < m_interval);
+}
+
+/*
+ * delay an image until the rate limit allows it, a newer one replaces it.
+ * The client is answered before it is drawn, so its header is read now,
+ * a damaged body still only shows up in the log.
+ */
+int VFDServer::park(int x, int y, const std::string &path, const std::string &data)
+{
+    if (!data.empty() || !VFD::isRaw(path.c_str()))
+    {
+        ImageDecoder *decoder = data.empty() ? ImageDecoder::open(path.c_str())
+            : ImageDecoder::open(data.data(), data.size());
+        if (!decoder)
+            return -1;
+        delete decoder;
+    }
+    if (m_hasPending)
+        m_dropped++;
+    m_hasPending = true;
+    m_pendingX = x;
+    m_pendingY = y;
+    m_pendingPath = path;
+    m_pendingData = data;
+    return 0;
+}
+
+VFDServer::~VFDServer()
+{
+    for (size_t i = 0; i < m_clients.size(); i++)
+        close(m_clients[i].fd);
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+        unlink(m_path.c_str());
+    }
+}
+
+int VFDServer::run()
+{
+    struct sockaddr_un addr;
+    if (fillAddress(addr, m_path.c_str()) < 0)
+    {
+        printf("[VFDServer] socket path too long: %s\n", m_path.c_str());
+        return -1;
+    }
+
+    VFDClient probe;
+    if (probe.connect(m_path.c_str()))
+    {
+        printf("[VFDServer] daemon already running on %s\n", m_path.c_str());
+        return -1;
+    }
+    unlink(m_path.c_str());
+
+    m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fd < 0)
+    {
+        printf("[VFDServer] socket failed (%m)\n");
+        return -1;
+    }
+    /* the umask keeps others out until the chmod, the chmod holds whatever the umask was */
+    mode_t mask = umask(0177);
+    int bound = bind(m_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (bound < 0 || chmod(m_path.c_str(), 0600) < 0 || listen(m_fd, 8) < 0)
+    {
+        printf("[VFDServer] bind %s failed (%m)\n", m_path.c_str());
+        if (bound == 0)
+            unlink(m_path.c_str());
+        close(m_fd);
+        m_fd = -1;
+        return -1;
+    }
+
+    /* poll() returns on SIGTERM */
+    catchStop();
+    signal(SIGPIPE, SIG_IGN);
+
+    bool quit = false;
+    std::vector<struct pollfd> fds;
+    while (!quit && !stopRequested())
+    {
+        fds.resize(m_clients.size() + 1);
+        fds[0].fd = m_fd;
+        for (size_t i = 0; i < m_clients.size(); i++)
+            fds[i + 1].fd = m_clients[i].fd;
+        for (size_t i = 0; i < fds.size(); i++)
+        {
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        int r = poll(&fds[0], fds.size(), timeout());
+        if (r == 0)
+            renderPending();
+        if (r < 0 && errno != EINTR)
+        {
+            printf("[VFDServer] poll failed (%m)\n");
+            break;
+        }
+        if (r <= 0)
+            continue;
+
+        /* backwards, a client that is done is dropped from the list */
+        for (size_t i = m_clients.size(); i-- > 0 && !quit;)
+        {
+            if (!fds[i + 1].revents)
+                continue;
+            if (!serve(m_clients[i], quit))
+            {
+                close(m_clients[i].fd);
+                m_clients.erase(m_clients.begin() + i);
+            }
+        }
+        if (!quit && (fds[0].revents & POLLIN))
+            accept();
+    }
+    renderPending();
+    return 0;
+}
+
+void VFDServer::accept()
+{
+    int fd = accept4(m_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+            printf("[VFDServer] accept failed (%m)\n");
+        return;
+    }
+    if (m_clients.size() >= VFD_MAX_CLIENTS)
+    {
+        printf("[VFDServer] too many clients\n");
+        close(fd);
+        return;
+    }
+    /* a client that doesn't read its replies must not stall the daemon */
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    Client client;
+    client.fd = fd;
+    m_clients.push_back(client);
+}
+
+static int reply(int fd, int code, const std::string &info)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", code);
+    std::string line = buf;
+    if (!info.empty())
+        line += " " + info;
+    line += "\n";
+    return writeAll(fd, line.data(), line.size());
+}
+
+/* handle what the client sent, returns false if the connection is done */
+bool VFDServer::serve(Client &client, bool &quit)
+{
+    char buf[65536];
+    ssize_t r = read(client.fd, buf, sizeof(buf));
+    if (r < 0 && (errno == EINTR || errno == EAGAIN))
+        return true;
+    if (r <= 0)
+        return false;
+    std::string &pending = client.pending;
+    pending.append(buf, r);
+
+    size_t nl;
+    while (!quit && (nl = pending.find('\n')) != std::string::npos)
+    {
+        if (nl > VFD_MAX_LINE)
+            break;
+        std::string line = pending.substr(0, nl);
+        std::string payload;
+        unsigned long len = 0;
+        int x, y;
+
+        /* pngdata is followed by the image itself */
+        if (sscanf(line.c_str(), "pngdata %d %d %lu", &x, &y, &len) == 3)
+        {
+            if (len > VFD_MAX_PNGDATA)
+            {
+                printf("[VFDServer] pngdata of %lu bytes refused\n", len);
+                reply(client.fd, -1, "too large");
+                return false;
+            }
+            if (pending.size() - nl - 1 < len)
+                return true;
+            payload = pending.substr(nl + 1, len);
+        }
+        pending.erase(0, nl + 1 + len);
+
+        std::string info;
+        int code = handleCommand(line, payload, quit, info);
+        if (reply(client.fd, code, info) < 0)
+            return false;
+    }
+
+    /* nothing that long is a command */
+    if (pending.size() > VFD_MAX_LINE && pending.find('\n') > VFD_MAX_LINE)
+    {
+        printf("[VFDServer] command line too long\n");
+        reply(client.fd, -1, "line too long");
+        return false;
+    }
+    return true;
+}
+
+int VFDServer::handleCommand(const std::string &line, const std::string &payload, bool &quit, std::string &info)
+{
+    char cmd[16];
+    int n = 0;
+
+    if (sscanf(line.c_str(), "%15s %n", cmd, &n) != 1)
+        return -1;
+
+    const char *args = line.c_str() + n;
+    if (!strcmp(cmd, "png"))
+    {
+        int x, y, off = 0;
+        if (sscanf(args, "%d %d %n", &x, &y, &off) != 2 || !args[off])
+            return -1;
+        if (rateLimited())
+            return park(x, y, args + off, std::string());
+        return render(args + off, x, y);
+    }
+    else if (!strcmp(cmd, "pngdata"))
+    {
+        int x, y;
+        if (sscanf(args, "%d %d", &x, &y) != 2 || payload.empty())
+            return -1;
+        if (rateLimited())
+            return park(x, y, std::string(), payload);
+        return render(payload, x, y);
+    }
+    else if (!strcmp(cmd, "brightness"))
+    {
+        int value;
+        if (sscanf(args, "%d", &value) != 1)
+            return -1;
+        return m_vfd->setLCDBrightness(value);
+    }
+    else if (!strcmp(cmd, "stats"))
+    {
+        char buf[192];
+        int len = snprintf(buf, sizeof(buf), "written=%u skipped=%u merged=%u dropped=%u",
+            m_vfd->writtenFrames(), m_vfd->skippedFrames(), m_vfd->mergedFrames(), m_dropped);
+        ImageCache *cache = m_vfd->imageCache();
+        if (cache)
+            snprintf(buf + len, sizeof(buf) - len, " cache_hits=%u cache_misses=%u cache_bytes=%zu",
+                cache->hits(), cache->misses(), cache->used());
+        info = buf;
+        return 0;
+    }
+    else if (!strcmp(cmd, "quit"))
+    {
+        quit = true;
+        return 0;
+    }
+    printf("[VFDServer] unknown command '%s'\n", cmd);
+    return -1;
+}
+
+VFDClient::VFDClient()
+{
+    m_fd = -1;
+}
+
+VFDClient::~VFDClient()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+bool VFDClient::connect(const char *path)
+{
+    struct sockaddr_un addr;
+    if (fillAddress(addr, path) < 0)
+        return false;
+
+    m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fd < 0)
+        return false;
+    if (::connect(m_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+int VFDClient::command(const std::string &line, std::string *info, const std::string *payload)
+{
+    if (m_fd < 0)
+        return -1;
+
+    std::string cmd = line + "\n";
+    if (writeAll(m_fd, cmd.data(), cmd.size()) < 0)
+        return -1;
+    if (payload && writeAll(m_fd, payload->data(), payload->size()) < 0)
+        return -1;
+
+    std::string reply;
+    char c;
+    while (true)
+    {
+        ssize_t r = read(m_fd, &c, 1);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        if (c == '\n')
+            break;
+        reply += c;
+    }
+    size_t sp = reply.find(' ');
+    if (info)
+        *info = sp == std::string::npos ? "" : reply.substr(sp + 1);
+    return atoi(reply.c_str());
+}
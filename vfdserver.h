@@ -0,0 +1,102 @@
+/*
+ Copyright (C) 2023 jbleyel
+
+ displayvfd is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ dogtag is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with displayvfd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _VFDSERVER_H_
+#define _VFDSERVER_H_
+
+#include <string>
+#include <vector>
+#include "vfd.h"
+
+/* only root may talk to the daemon, the socket is created 0600 */
+#define VFD_SOCKET_PATH "/run/displayvfd.socket"
+#define VFD_MAX_PNGDATA (32 * 1024 * 1024)
+#define VFD_MAX_LINE 4096
+#define VFD_MAX_CLIENTS 16
+
+/*
+ * Line based protocol, one command per line, every command is answered
+ * with a single line holding the result code, optionally followed by text:
+ *
+ *   png <x> <y> <path>     clear the panel and draw an image, with a rate
+ *                          limit a burst of images only draws the newest
+ *   pngdata <x> <y> <len>  the same for a png that follows as len bytes
+ *   brightness <value>     set the panel brightness for this and later frames
+ *   stats                  frame and image cache counters
+ *   quit                   stop the daemon
+ *
+ * Clients are served side by side, one that stays silent holds up no one.
+ */
+class VFDServer
+{
+private:
+    VFD *m_vfd;
+    std::string m_path;
+    int m_fd;
+
+    struct Client
+    {
+        int fd;
+        std::string pending; /* received, not yet handled */
+    };
+    std::vector<Client> m_clients;
+
+    /* render coalescing */
+    int m_interval; /* ms */
+    struct timespec m_last;
+    bool m_hasPending;
+    int m_pendingX, m_pendingY;
+    std::string m_pendingPath;
+    std::string m_pendingData;
+    unsigned int m_dropped;
+
+    long sinceLast();
+    int timeout();
+    int render(const char *path, int x, int y);
+    int render(const std::string &data, int x, int y);
+    void renderPending();
+    bool rateLimited();
+    int park(int x, int y, const std::string &path, const std::string &data);
+    void accept();
+    bool serve(Client &client, bool &quit);
+    int handleCommand(const std::string &line, const std::string &payload, bool &quit, std::string &info);
+
+public:
+    VFDServer(VFD *vfd, const char *path = VFD_SOCKET_PATH);
+    ~VFDServer();
+
+    /* at most fps renders per second, 0 renders every request */
+    void setMaxRate(int fps);
+    int run();
+};
+
+class VFDClient
+{
+private:
+    int m_fd;
+
+public:
+    VFDClient();
+    ~VFDClient();
+
+    /* returns false if no daemon is listening on path */
+    bool connect(const char *path = VFD_SOCKET_PATH);
+    /* payload is sent right after the command line */
+    int command(const std::string &line, std::string *info = NULL, const std::string *payload = NULL);
+};
+
+#endif